@@ -25,14 +25,25 @@
 typedef unsigned long in_addr_t; // Define in_addr_t for Windows
 #else
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/select.h>
 #include <endian.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
 #endif
 
+#include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <errno.h>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
 
 #include "common.h"
 
@@ -177,43 +188,497 @@ int get_ms(uint64_t *ms) {
 #endif
 }
 
-int32_t get_srt_sn(void *pkt, int n) {
-  if (n < 4) return -1;
+int get_us(uint64_t *us) {
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    static int initialized = 0;
+    LARGE_INTEGER counter;
+    if (!initialized) {
+        QueryPerformanceFrequency(&freq);
+        initialized = 1;
+    }
+    QueryPerformanceCounter(&counter);
+    *us = (uint64_t)(counter.QuadPart / freq.QuadPart) * 1000000 +
+          (uint64_t)(counter.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+    return 0;
+#else
+  struct timespec ts;
+  int ret = clock_gettime(CLOCK_MONOTONIC , &ts);
+  if (ret != 0) return -1;
+  *us = ((uint64_t)(ts.tv_sec)) * 1000 * 1000 + ((uint64_t)(ts.tv_nsec)) / 1000;
 
-  uint32_t sn = be32toh(*((uint32_t *)pkt));
-  if ((sn & (1 << 31)) == 0) {
-    return (int32_t)sn;
+  return 0;
+#endif
+}
+
+/*
+  Packet buffer pool
+
+  Fixed size, cache aligned buffers with a reference count. A packet that's
+  queued in several places or handed over to another thread is shared
+  rather than copied, and goes back to the freelist when its last reference
+  is dropped. Buffers can be freed from any thread.
+
+  Each thread allocates from and frees to its own cache, without any
+  locking. Buffers move between the caches and a shared stack in batches
+  of PKT_CACHE_BATCH: a cache that runs dry takes a batch, one that grows
+  past twice that gives one back. The shared stack is lock-free: batches
+  are pushed with a CAS, and popped by taking the whole stack at once and
+  pushing the rest back, which can't suffer from ABA. When there's no
+  batch to take, the pool grows by PKT_POOL_CHUNK buffers. It never
+  shrinks, so it stops calling malloc() once it has reached the working
+  set. The statistics are plain per-thread counters, only summed up by
+  pkt_pool_get_stats()
+*/
+#define PKT_POOL_CHUNK  64
+#define PKT_CACHE_BATCH 32
+
+typedef struct pkt_cache {
+  struct pkt_cache *next; // in pkt_caches, never removed
+  int claimed; // by a running thread
+  pkt_buf_t *free;
+  int cnt;
+  /* written only by the owning thread */
+  uint64_t allocs;
+  int64_t in_use; // can go negative, when other threads free our buffers
+} pkt_cache_t;
+
+pkt_buf_t *pkt_pool_shared = NULL; // batches, linked by next_batch
+pkt_cache_t *pkt_caches = NULL;
+uint64_t pkt_pool_mallocs = 0;
+int pkt_pool_total = 0;
+
+#ifdef _WIN32
+// The Windows build is single threaded
+static pkt_cache_t *pkt_cache = NULL;
+#else
+static __thread pkt_cache_t *pkt_cache = NULL;
+pthread_key_t pkt_cache_key;
+pthread_once_t pkt_cache_key_once = PTHREAD_ONCE_INIT;
+#endif
+
+// Single writer counters, read by other threads with relaxed loads
+#define pkt_stat_add(p, v) \
+  __atomic_store_n((p), __atomic_load_n((p), __ATOMIC_RELAXED) + (v), __ATOMIC_RELAXED)
+
+void pkt_pool_push(pkt_buf_t *head, pkt_buf_t *tail) {
+  pkt_buf_t *top = __atomic_load_n(&pkt_pool_shared, __ATOMIC_RELAXED);
+  do {
+    tail->next_batch = top;
+  } while (!__atomic_compare_exchange_n(&pkt_pool_shared, &top, head, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+pkt_buf_t *pkt_pool_pop() {
+  pkt_buf_t *top = __atomic_exchange_n(&pkt_pool_shared, NULL, __ATOMIC_ACQUIRE);
+  if (top == NULL) return NULL;
+
+  pkt_buf_t *rest = top->next_batch;
+  if (rest != NULL) {
+    pkt_buf_t *tail = rest;
+    while (tail->next_batch != NULL) tail = tail->next_batch;
+    pkt_pool_push(rest, tail);
+  }
+  return top;
+}
+
+// Hands the first cnt buffers of the cache over to the shared stack
+void pkt_cache_flush(pkt_cache_t *pc, int cnt) {
+  pkt_buf_t *head = pc->free;
+  pkt_buf_t *tail = head;
+  for (int i = 1; i < cnt; i++) tail = tail->next_free;
+  pc->free = tail->next_free;
+  pc->cnt -= cnt;
+  tail->next_free = NULL;
+  pkt_pool_push(head, head);
+}
+
+#ifndef _WIN32
+// Gives the cache of an exiting thread back, for the next thread to claim
+void pkt_cache_release(void *arg) {
+  pkt_cache_t *pc = arg;
+  if (pc->cnt > 0) pkt_cache_flush(pc, pc->cnt);
+  pkt_cache = NULL;
+  __atomic_store_n(&pc->claimed, 0, __ATOMIC_RELEASE);
+}
+
+void pkt_cache_key_init() {
+  pthread_key_create(&pkt_cache_key, pkt_cache_release);
+}
+#endif
+
+pkt_cache_t *pkt_cache_get() {
+  if (pkt_cache != NULL) return pkt_cache;
+
+  pkt_cache_t *pc;
+  for (pc = __atomic_load_n(&pkt_caches, __ATOMIC_ACQUIRE); pc != NULL; pc = pc->next) {
+    int unclaimed = 0;
+    if (__atomic_compare_exchange_n(&pc->claimed, &unclaimed, 1, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
+  }
+  if (pc == NULL) {
+    pc = calloc(1, sizeof(*pc));
+    if (pc == NULL) return NULL;
+    pc->claimed = 1;
+    pc->next = __atomic_load_n(&pkt_caches, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&pkt_caches, &pc->next, pc, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  }
+
+#ifndef _WIN32
+  pthread_once(&pkt_cache_key_once, pkt_cache_key_init);
+  pthread_setspecific(pkt_cache_key, pc);
+#endif
+  pkt_cache = pc;
+  return pc;
+}
+
+int pkt_cache_refill(pkt_cache_t *pc) {
+  pkt_buf_t *batch = pkt_pool_pop();
+  if (batch != NULL) {
+    pc->free = batch;
+    for (pkt_buf_t *b = batch; b != NULL; b = b->next_free) pc->cnt++;
+    return 0;
+  }
+
+  char *chunk = malloc(sizeof(pkt_buf_t) * PKT_POOL_CHUNK + PKT_BUF_ALIGN - 1);
+  if (chunk == NULL) return -1;
+
+  uintptr_t aligned = ((uintptr_t)chunk + PKT_BUF_ALIGN - 1) & ~(uintptr_t)(PKT_BUF_ALIGN - 1);
+  pkt_buf_t *bufs = (pkt_buf_t *)aligned;
+  for (int i = 0; i < PKT_POOL_CHUNK; i++) {
+    bufs[i].next_free = pc->free;
+    pc->free = &bufs[i];
+  }
+  pc->cnt += PKT_POOL_CHUNK;
+  __atomic_fetch_add(&pkt_pool_mallocs, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&pkt_pool_total, PKT_POOL_CHUNK, __ATOMIC_RELAXED);
+
+  return 0;
+}
+
+// Returns a buffer with a single reference, or NULL if out of memory
+pkt_buf_t *pkt_buf_alloc() {
+  pkt_cache_t *pc = pkt_cache_get();
+  if (pc == NULL) return NULL;
+  if (pc->free == NULL && pkt_cache_refill(pc) != 0) return NULL;
+
+  pkt_buf_t *b = pc->free;
+  pc->free = b->next_free;
+  pc->cnt--;
+  pkt_stat_add(&pc->allocs, 1);
+  pkt_stat_add(&pc->in_use, 1);
+
+  b->next_free = NULL;
+  b->refs = 1;
+  b->len = 0;
+  return b;
+}
+
+void pkt_buf_ref(pkt_buf_t *b) {
+  __atomic_fetch_add(&b->refs, 1, __ATOMIC_RELAXED);
+}
+
+void pkt_buf_unref(pkt_buf_t *b) {
+  if (b == NULL) return;
+  if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) != 0) return;
+
+  pkt_cache_t *pc = pkt_cache_get();
+  if (pc == NULL) {
+    // Out of memory for a cache, hand the buffer straight to the others
+    b->next_free = NULL;
+    pkt_pool_push(b, b);
+    return;
+  }
+  b->next_free = pc->free;
+  pc->free = b;
+  pc->cnt++;
+  pkt_stat_add(&pc->in_use, -1);
+  if (pc->cnt >= 2 * PKT_CACHE_BATCH) {
+    pkt_cache_flush(pc, PKT_CACHE_BATCH);
+  }
+}
+
+void pkt_pool_get_stats(pkt_pool_stats_t *stats) {
+  memset(stats, 0, sizeof(*stats));
+  stats->mallocs = __atomic_load_n(&pkt_pool_mallocs, __ATOMIC_RELAXED);
+  stats->total = __atomic_load_n(&pkt_pool_total, __ATOMIC_RELAXED);
+  int64_t in_use = 0;
+  for (pkt_cache_t *pc = __atomic_load_n(&pkt_caches, __ATOMIC_ACQUIRE); pc != NULL; pc = pc->next) {
+    stats->allocs += __atomic_load_n(&pc->allocs, __ATOMIC_RELAXED);
+    in_use += __atomic_load_n(&pc->in_use, __ATOMIC_RELAXED);
   }
+  stats->in_use = (int)in_use;
+}
+
+/*
+  Metrics endpoint
+
+  metrics_listen() opens the socket given with --metrics: a UNIX socket if
+  the argument contains a '/', otherwise a TCP port on 127.0.0.1, or on the
+  address given as IP:PORT. Each client gets one snapshot in the Prometheus
+  text format and is then disconnected. Clients that send an HTTP request
+  get an HTTP response, so that Prometheus can scrape the endpoint
+  directly, the others just get the metrics. Scrapes are served from the
+  event loop, which is the only place the counters are read from: the
+  snapshot is taken when the client connects, then its socket is
+  non-blocking and metrics_poll() reads the request and writes the
+  response whenever the loop comes around, so slow clients can't stall it
+*/
+#define METRICS_MAX_CLIENTS  4
+#define METRICS_REQ_TIMEOUT  100  // ms, for the client to send its request
+#define METRICS_SEND_TIMEOUT 1000 // ms, for the whole exchange
+
+typedef struct {
+  int active;
+  int fd;
+  uint64_t start; // ms
+  char req[512];
+  int req_len;
+  int replying;
+  char hdr[128];
+  int hdr_len;
+  metrics_buf_t body;
+  int sent; // of the header and the body
+} metrics_client_t;
+
+metrics_client_t metrics_clients[METRICS_MAX_CLIENTS];
+int metrics_client_cnt = 0;
+
+#ifdef _WIN32
+#define sock_close closesocket
+#else
+#define sock_close close
+#endif
+
+int metrics_listen(const char *spec) {
+  int fd;
+#ifndef _WIN32
+  if (strchr(spec, '/') != NULL) {
+    struct sockaddr_un addr = {0};
+    if (strlen(spec) >= sizeof(addr.sun_path)) return -1;
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, spec);
+
+    // Replace a socket left behind by an earlier run, but no other file
+    struct stat st;
+    if (lstat(spec, &st) == 0) {
+      if (!S_ISSOCK(st.st_mode)) return -1;
+      unlink(spec);
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) goto err;
+  } else
+#endif
+  {
+    char host[64] = "127.0.0.1";
+    const char *port = strrchr(spec, ':');
+    if (port != NULL) {
+      int host_len = port - spec;
+      if (host_len >= (int)sizeof(host)) return -1;
+      memcpy(host, spec, host_len);
+      host[host_len] = '\0';
+      port++;
+    } else {
+      port = spec;
+    }
 
+    struct sockaddr_in addr;
+    int port_no = parse_port((char *)port);
+    if (parse_ip(&addr, host) != 0 || port_no < 0) return -1;
+    addr.sin_port = htons(port_no);
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+#ifndef _WIN32
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+    int yes = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const char *)&yes, sizeof(yes));
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) goto err;
+  }
+
+  if (listen(fd, 8) != 0) goto err;
+
+  // Spurious wake-ups mustn't block the event loop in accept()
+#ifdef _WIN32
+  u_long nonblocking = 1;
+  ioctlsocket(fd, FIONBIO, &nonblocking);
+#else
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+#endif
+  return fd;
+
+err:
+  sock_close(fd);
   return -1;
 }
 
-uint16_t get_srt_type(void *pkt, int n) {
-  if (n < 2) return 0;
-  return be16toh(*((uint16_t *)pkt));
+void metrics_printf(metrics_buf_t *m, const char *fmt, ...) {
+  if (m->len < 0) return; // out of memory earlier
+
+  while (1) {
+    va_list args;
+    va_start(args, fmt);
+    int ret = vsnprintf(m->buf + m->len, m->cap - m->len, fmt, args);
+    va_end(args);
+    if (ret < 0) return;
+    if (ret < m->cap - m->len) {
+      m->len += ret;
+      return;
+    }
+
+    int cap = m->cap ? m->cap * 2 : 4096;
+    while (cap - m->len <= ret) cap *= 2;
+    char *buf = realloc(m->buf, cap);
+    if (buf == NULL) {
+      m->len = -1;
+      return;
+    }
+    m->buf = buf;
+    m->cap = cap;
+  }
 }
 
-int is_srt_ack(void *pkt, int n) {
-  return get_srt_type(pkt, n) == SRT_TYPE_ACK;
+// Prints the HELP and TYPE lines that start a metric family
+void metrics_family(metrics_buf_t *m, const metric_desc_t *desc) {
+  metrics_printf(m, "# HELP %s %s\n# TYPE %s %s\n",
+                 desc->name, desc->help, desc->name, desc->type);
 }
 
-int is_srtla_keepalive(void *pkt, int n) {
-  return get_srt_type(pkt, n) == SRTLA_TYPE_KEEPALIVE;
+// For the metrics without labels
+void metrics_single(metrics_buf_t *m, const char *name, const char *type,
+                    const char *help, double value) {
+  metric_desc_t desc = {name, type, help};
+  metrics_family(m, &desc);
+  metrics_printf(m, "%s %.15g\n", name, value);
 }
 
-int is_srtla_reg1(void *pkt, int len) {
-  if (len != SRTLA_TYPE_REG1_LEN) return 0;
-  return get_srt_type(pkt, len) == SRTLA_TYPE_REG1;
+int metrics_sock_would_block() {
+#ifdef _WIN32
+  return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+  return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
 }
 
-int is_srtla_reg2(void *pkt, int len) {
-  if (len != SRTLA_TYPE_REG2_LEN) return 0;
-  return get_srt_type(pkt, len) == SRTLA_TYPE_REG2;
+void metrics_client_close(metrics_client_t *cl) {
+  sock_close(cl->fd);
+  free(cl->body.buf);
+  cl->body.buf = NULL;
+  cl->active = 0;
+  metrics_client_cnt--;
 }
 
-int is_srtla_reg3(void *pkt, int len) {
-  if (len != SRTLA_TYPE_REG3_LEN) return 0;
-  return get_srt_type(pkt, len) == SRTLA_TYPE_REG3;
+void metrics_serve(int listen_fd, void (*fill)(metrics_buf_t *m)) {
+  while (1) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) break;
+
+    metrics_client_t *cl = NULL;
+    for (int i = 0; i < METRICS_MAX_CLIENTS && cl == NULL; i++) {
+      if (!metrics_clients[i].active) cl = &metrics_clients[i];
+    }
+    if (cl == NULL) {
+      sock_close(fd);
+      continue;
+    }
+
+#ifdef _WIN32
+    u_long nonblocking = 1;
+    ioctlsocket(fd, FIONBIO, &nonblocking);
+#else
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+    memset(cl, 0, sizeof(*cl));
+    cl->active = 1;
+    cl->fd = fd;
+    get_ms(&cl->start);
+    fill(&cl->body);
+    metrics_client_cnt++;
+    if (cl->body.len < 0) metrics_client_close(cl);
+  }
+
+  metrics_poll();
+}
+
+int metrics_busy() {
+  return metrics_client_cnt > 0;
+}
+
+/* Returns 1 once the client is done with, successfully or not */
+int metrics_client_step(metrics_client_t *cl, uint64_t ms) {
+  if (ms >= cl->start + METRICS_SEND_TIMEOUT) return 1;
+
+  /* Read the request, if any, as closing the socket with it still unread
+     would reset the connection before the client gets the response */
+  if (!cl->replying) {
+    while (cl->req_len < (int)sizeof(cl->req)) {
+      int ret = recv(cl->fd, cl->req + cl->req_len, sizeof(cl->req) - cl->req_len, 0);
+      if (ret < 0 && metrics_sock_would_block()) break;
+      if (ret <= 0) {
+        // Closed its end, maybe after sending the request
+        if (cl->req_len == 0) return 1;
+        break;
+      }
+      cl->req_len += ret;
+    }
+    if (cl->req_len == 0 && ms < cl->start + METRICS_REQ_TIMEOUT) return 0;
+
+    cl->replying = 1;
+    if (cl->req_len >= 4 && memcmp(cl->req, "GET ", 4) == 0) {
+      cl->hdr_len = snprintf(cl->hdr, sizeof(cl->hdr),
+                             "HTTP/1.0 200 OK\r\n"
+                             "Content-Type: text/plain; version=0.0.4\r\n"
+                             "Content-Length: %d\r\n\r\n", cl->body.len);
+    }
+  }
+
+  while (cl->sent < cl->hdr_len + cl->body.len) {
+    const char *buf;
+    int len;
+    if (cl->sent < cl->hdr_len) {
+      buf = cl->hdr + cl->sent;
+      len = cl->hdr_len - cl->sent;
+    } else {
+      buf = cl->body.buf + cl->sent - cl->hdr_len;
+      len = cl->body.len - (cl->sent - cl->hdr_len);
+    }
+    int ret = send(cl->fd, buf, len, 0);
+    if (ret < 0 && metrics_sock_would_block()) return 0;
+    if (ret <= 0) return 1;
+    cl->sent += ret;
+  }
+
+  return 1;
+}
+
+void metrics_poll() {
+  if (metrics_client_cnt == 0) return;
+
+  uint64_t ms;
+  if (get_ms(&ms) != 0) return;
+  for (int i = 0; i < METRICS_MAX_CLIENTS; i++) {
+    metrics_client_t *cl = &metrics_clients[i];
+    if (cl->active && metrics_client_step(cl, ms)) {
+      metrics_client_close(cl);
+    }
+  }
+}
+
+int32_t get_srt_sn(void *pkt, int n) {
+  if (n < 4) return -1;
+
+  uint32_t sn = pkt_be32(pkt, 0);
+  if ((sn & (1 << 31)) == 0) {
+    return (int32_t)sn;
+  }
+
+  return -1;
 }
 
 // Ensure WSAStartup is initialized for Windows
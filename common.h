@@ -17,6 +17,7 @@
 */
 
 #include <stdint.h>
+#include <string.h>
 
 #define MTU 1500
 
@@ -33,6 +34,7 @@
 #define SRTLA_TYPE_REG_ERR   0x9210
 #define SRTLA_TYPE_REG_NGP   0x9211
 #define SRTLA_TYPE_REG_NAK   0x9212
+#define SRTLA_TYPE_FEC       0x9300
 
 #define SRT_MIN_LEN          16
 
@@ -41,6 +43,29 @@
 #define SRTLA_TYPE_REG2_LEN  (2 + (SRTLA_ID_LEN))
 #define SRTLA_TYPE_REG3_LEN  2
 
+/* REG1 and REG2 may be followed by a 32 bit capability bitmask. A receiver
+   that supports it answers a REG1 carrying capabilities with a REG2 carrying
+   the subset it accepts */
+#define SRTLA_CAPS_LEN            4
+#define SRTLA_TYPE_REG1_CAPS_LEN  (SRTLA_TYPE_REG1_LEN + SRTLA_CAPS_LEN)
+#define SRTLA_TYPE_REG2_CAPS_LEN  (SRTLA_TYPE_REG2_LEN + SRTLA_CAPS_LEN)
+#define SRTLA_CAP_FEC             0x00000001
+
+/* XOR FEC: one parity packet protects up to FEC_MAX_K data packets. It lists
+   their sequence numbers, followed by the XOR of the packets zero-padded to
+   the longest one */
+#define FEC_MAX_K 16
+
+typedef struct __attribute__((__packed__)) {
+  uint16_t type;
+  uint8_t  k;
+  uint8_t  reserved;
+  uint16_t len_xor;
+  uint32_t sns[];
+} srtla_fec_header_t;
+
+#define SRTLA_FEC_HDR_LEN(k) (sizeof(srtla_fec_header_t) + (k) * sizeof(uint32_t))
+
 typedef struct __attribute__((__packed__)) {
   uint16_t type;
   uint16_t subtype;
@@ -92,6 +117,56 @@ typedef enum {
 #define CONN_DEAD_NO_ACTIVITY_MS 5000
 #endif
 
+/* Packet buffers, shared by reference between the queues and threads that
+   hold a packet, see common.c */
+#define PKT_BUF_ALIGN 64 // cache line
+
+typedef struct pkt_buf {
+  struct pkt_buf *next_free;
+  struct pkt_buf *next_batch; // in the shared stack of the pool, see common.c
+  int refs;
+  int len;
+  char data[MTU] __attribute__((aligned(PKT_BUF_ALIGN)));
+} pkt_buf_t;
+
+typedef struct {
+  uint64_t allocs;  // pkt_buf_alloc() calls
+  uint64_t mallocs; // of whole chunks, stays put once the pool is warm
+  int total;
+  int in_use;
+} pkt_pool_stats_t;
+
+pkt_buf_t *pkt_buf_alloc(void);
+void pkt_buf_ref(pkt_buf_t *b);
+void pkt_buf_unref(pkt_buf_t *b);
+void pkt_pool_get_stats(pkt_pool_stats_t *stats);
+
+/* Metrics endpoint, see common.c */
+typedef struct {
+  char *buf;
+  int len; // -1 if we ran out of memory
+  int cap;
+} metrics_buf_t;
+
+typedef struct {
+  const char *name;
+  const char *type; // counter or gauge
+  const char *help;
+} metric_desc_t;
+
+int metrics_listen(const char *spec);
+void metrics_printf(metrics_buf_t *m, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+void metrics_family(metrics_buf_t *m, const metric_desc_t *desc);
+void metrics_single(metrics_buf_t *m, const char *name, const char *type,
+                    const char *help, double value);
+void metrics_serve(int listen_fd, void (*fill)(metrics_buf_t *m));
+/* While metrics_busy(), the event loops call metrics_poll() at least every
+   METRICS_POLL_INT to make progress on the clients being served */
+#define METRICS_POLL_INT 10 // ms
+int metrics_busy();
+void metrics_poll();
+
 /* Helper for more explanatory socket error strings */
 const char *sock_err_str();
 int is_fatal_udp_error(int err);
@@ -128,6 +203,7 @@ void exit_help();
 
 int get_seconds(time_t *s);
 int get_ms(uint64_t *ms);
+int get_us(uint64_t *us);
 
 const char *print_addr(struct sockaddr *addr);
 int port_no(struct sockaddr *addr);
@@ -135,15 +211,8 @@ int parse_ip(struct sockaddr_in *addr, char *ip_str);
 int parse_port(char *port_str);
 
 int32_t get_srt_sn(void *pkt, int n);
-uint16_t get_srt_type(void *pkt, int n);
-int is_srt_ack(void *pkt, int n);
 int is_srt_shutdown(void *pkt, int n);
 
-int is_srtla_keepalive(void *pkt, int len);
-int is_srtla_reg1(void *pkt, int len);
-int is_srtla_reg2(void *pkt, int len);
-int is_srtla_reg3(void *pkt, int len);
-
 #ifdef _WIN32
 // Windows için byte order makroları
 #include <winsock2.h>
@@ -161,3 +230,113 @@ int is_srtla_reg3(void *pkt, int len);
 #define be16toh(x) ntohs(x)
 #endif
 #endif
+
+#define SRT_RETRANS_FLAG (1 << 26) // R flag in the message number field
+
+/*
+  Packet descriptors
+
+  pkt_parse() reads a packet's header once, and the hot paths dispatch on
+  the result instead of calling the get_*() and is_*() helpers one after
+  the other. Packets can start at any offset of a buffer, so the fields are
+  read with memcpy(). srtla packets with an invalid length are invalid,
+  they mustn't be forwarded as the SRT control packets they look like
+*/
+typedef enum {
+  PKT_T_INVALID = 0, // too short, or a malformed srtla packet
+  PKT_T_SRT_DATA,
+  PKT_T_SRT_ACK,
+  PKT_T_SRT_NAK,
+  PKT_T_SRT_CONTROL, // any other SRT control packet
+  PKT_T_SRTLA_KEEPALIVE,
+  PKT_T_SRTLA_ACK,
+  PKT_T_SRTLA_REG1,
+  PKT_T_SRTLA_REG2,
+  PKT_T_SRTLA_REG3,
+  PKT_T_SRTLA_REG_ERR,
+  PKT_T_SRTLA_REG_NGP,
+  PKT_T_SRTLA_REG_NAK,
+  PKT_T_SRTLA_FEC,
+} pkt_type_t;
+
+typedef struct {
+  pkt_type_t type;
+  int len;
+  int32_t sn;      // of data packets, -1 otherwise
+  int retrans;     // the R flag of data packets
+  uint32_t ack_no; // of SRT ACKs
+  uint32_t ack_sn; // of SRT ACKs, the next sequence number expected
+} pkt_desc_t;
+
+static inline uint16_t pkt_be16(const void *pkt, int off) {
+  uint16_t v;
+  memcpy(&v, (const char *)pkt + off, sizeof(v));
+  return be16toh(v);
+}
+
+static inline uint32_t pkt_be32(const void *pkt, int off) {
+  uint32_t v;
+  memcpy(&v, (const char *)pkt + off, sizeof(v));
+  return be32toh(v);
+}
+
+static inline void pkt_parse(pkt_desc_t *d, const void *pkt, int n) {
+  d->type = PKT_T_INVALID;
+  d->len = n;
+  d->sn = -1;
+  d->retrans = 0;
+  d->ack_no = 0;
+  d->ack_sn = 0;
+  if (n < 2) return;
+
+  uint16_t type = pkt_be16(pkt, 0);
+  if (!(type & 0x8000)) {
+    if (n < SRT_MIN_LEN) return;
+    d->type = PKT_T_SRT_DATA;
+    d->sn = pkt_be32(pkt, 0);
+    d->retrans = (pkt_be32(pkt, 4) & SRT_RETRANS_FLAG) != 0;
+    return;
+  }
+
+  d->type = PKT_T_SRT_CONTROL;
+  switch (type) {
+    case SRT_TYPE_ACK:
+      if (n < SRT_MIN_LEN + 4) return;
+      d->type = PKT_T_SRT_ACK;
+      d->ack_no = pkt_be32(pkt, 4);
+      d->ack_sn = pkt_be32(pkt, SRT_MIN_LEN);
+      return;
+    case SRT_TYPE_NAK:
+      d->type = PKT_T_SRT_NAK;
+      return;
+    case SRTLA_TYPE_KEEPALIVE:
+      d->type = PKT_T_SRTLA_KEEPALIVE;
+      return;
+    case SRTLA_TYPE_ACK:
+      d->type = PKT_T_SRTLA_ACK;
+      return;
+    case SRTLA_TYPE_REG1:
+      d->type = (n == SRTLA_TYPE_REG1_LEN || n == SRTLA_TYPE_REG1_CAPS_LEN) ?
+                PKT_T_SRTLA_REG1 : PKT_T_INVALID;
+      return;
+    case SRTLA_TYPE_REG2:
+      d->type = (n == SRTLA_TYPE_REG2_LEN || n == SRTLA_TYPE_REG2_CAPS_LEN) ?
+                PKT_T_SRTLA_REG2 : PKT_T_INVALID;
+      return;
+    case SRTLA_TYPE_REG3:
+      d->type = (n == SRTLA_TYPE_REG3_LEN) ? PKT_T_SRTLA_REG3 : PKT_T_INVALID;
+      return;
+    case SRTLA_TYPE_REG_ERR:
+      d->type = PKT_T_SRTLA_REG_ERR;
+      return;
+    case SRTLA_TYPE_REG_NGP:
+      d->type = PKT_T_SRTLA_REG_NGP;
+      return;
+    case SRTLA_TYPE_REG_NAK:
+      d->type = PKT_T_SRTLA_REG_NAK;
+      return;
+    case SRTLA_TYPE_FEC:
+      d->type = PKT_T_SRTLA_FEC;
+      return;
+  }
+}
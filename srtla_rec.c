@@ -44,10 +44,27 @@ typedef unsigned long in_addr_t; // Define in_addr_t for Windows
 #endif
 #ifndef _WIN32
 #include <netdb.h>
+#include <signal.h>
+#include <sys/un.h>
 #endif
 #include <sys/types.h>
 #ifdef __linux__
 #include <sys/epoll.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+// Multishot receives with provided buffer rings need the Linux 6.0 headers
+#ifdef IORING_RECV_MULTISHOT
+#define HAVE_IO_URING
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
+#endif
+#endif
+#ifndef _WIN32
+#include <sys/resource.h>
 #endif
 #include <errno.h>
 
@@ -58,8 +75,80 @@ typedef unsigned long in_addr_t; // Define in_addr_t for Windows
 
 #define CLEANUP_PERIOD 3
 #define GROUP_TIMEOUT  10
+#define GROUP_REG2_WAIT 4 // s, how long srtla_send waits for a REG2
 #define CONN_TIMEOUT   10
 
+#ifndef min
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+/* Capabilities we accept during registration */
+#define SRTLA_SUPPORTED_CAPS SRTLA_CAP_FEC
+
+/* SRT backend health checks, only done with more than one backend */
+#define BACKEND_CHECK_INT 1 // s
+#define BACKEND_FAIL_MAX  3 // unanswered checks before a backend is marked down
+#define BACKEND_LOG_RATE_CHG 25 // %, bitrate change that gets the load logged
+#define BACKEND_LOG_RATE_MIN (100 * 1000 / 8) // bytes/s, and at least this much
+/* Startup probing of the resolved addresses of each backend */
+#define SRT_PROBE_TIMEOUT 1000 // ms, shared by all the probes
+#define SRT_PROBE_MAX_ADDRS 8
+
+/* Hot restart: state handed over to a new srtla_rec, see hot_restart_handoff() */
+#define HOT_RESTART_MAGIC   0x73726c68 // "srlh"
+#define HOT_RESTART_VERSION 1
+#define HOT_RESTART_ACK_TIMEOUT 2 // s, for the new process to confirm the takeover
+
+/* Recently received data packets kept for FEC recovery, per group */
+#define FEC_RX_WINDOW 64
+#define FEC_HELD_MAX  4  // parity packets waiting for the reordering to settle
+#define FEC_HOLD_MS   50 // longest a parity packet is held back
+
+typedef struct {
+  int32_t sn;
+  int len;
+  int rebuilt; // from the parity, and forwarded
+  char buf[MTU];
+} fec_rx_pkt_t;
+
+typedef struct {
+  int32_t last; // newest packet the parity protects, -1 if the slot is free
+  int len;
+  uint64_t deadline; // ms
+  char buf[MTU];
+} fec_held_t;
+
+typedef enum {
+  PLACE_LEAST_GROUPS = 0,
+  PLACE_LEAST_BITRATE,
+} placement_t;
+
+typedef struct srt_backend {
+  struct srt_backend *next;
+  char *host;
+  char *port;
+  struct sockaddr addr;
+  int healthy;
+  int check_sock; // for the health checks, -1 if none
+  int check_fails;
+  int groups;
+  int64_t bytes; // forwarded since the last health check
+  int64_t bitrate; // bytes/s, smoothed
+  /* last load logged at the info level, see backend_log_load() */
+  int logged;
+  int logged_healthy;
+  int logged_groups;
+  int64_t logged_bitrate;
+  /* address probing, see resolve_srt_addr() */
+  int probe_cnt; // 0 once an address has been chosen
+  int probe_socks[SRT_PROBE_MAX_ADDRS];
+  struct sockaddr probe_addrs[SRT_PROBE_MAX_ADDRS];
+  uint64_t probe_deadline;
+} srt_backend_t;
+
 #define RECV_ACK_INT 10
 typedef struct srtla_conn {
   struct srtla_conn *next;
@@ -72,6 +161,11 @@ typedef struct srtla_conn {
   time_t next_reg_try_ms;
   int backoff_ms;
   int had_fatal_error;
+  /* counters for the metrics endpoint, see metrics_fill() */
+  uint64_t rcvd_pkts;
+  uint64_t rcvd_bytes;
+  uint64_t keepalives;
+  uint64_t acks_sent;
 } conn_t;
 
 typedef struct srtla_conn_group {
@@ -79,6 +173,7 @@ typedef struct srtla_conn_group {
   conn_t *conns;
   time_t created_at;
   int srt_sock;
+  srt_backend_t *backend; // NULL until the SRT socket is first opened
   struct sockaddr last_addr;
   char id[SRTLA_ID_LEN];
   /* reconnection state */
@@ -86,6 +181,26 @@ typedef struct srtla_conn_group {
   group_state state;
   time_t next_srt_retry_ms;
   int srt_retry_attempts;
+  /* reordering statistics, the distance is counted in packets */
+  int32_t max_sn;
+  int reordered_pkts;
+  int reorder_dist_max;
+  int64_t reorder_dist_sum;
+  /* negotiated capabilities */
+  uint32_t caps;
+  fec_rx_pkt_t *fec_rx; // indexed by sn % FEC_RX_WINDOW
+  fec_held_t fec_held[FEC_HELD_MAX];
+  int fec_held_cnt;
+  int fec_recovered;
+  int fec_unrecoverable;
+  uint64_t uring_ud; // of the io_uring receive on srt_sock, 0 if none
+  /* counters for the metrics endpoint, kept here as conns come and go */
+  uint64_t rcvd_pkts;
+  uint64_t rcvd_bytes;
+  uint64_t fwd_pkts;  // to the SRT server
+  uint64_t fwd_bytes;
+  uint64_t srt_pkts;  // from the SRT server
+  uint64_t srt_bytes;
 } conn_group_t;
 
 typedef struct {
@@ -107,7 +222,9 @@ Manual testing scenarios:
 
 
 int srtla_sock;
-struct sockaddr srt_addr;
+srt_backend_t *backends = NULL;
+int backend_count = 0;
+int backends_probing = 0;
 const socklen_t addr_len = sizeof(struct sockaddr);
 
 conn_group_t *groups = NULL;
@@ -118,6 +235,19 @@ static uint64_t global_group_seq = 1;
 int flag_auto_reconnect = 1;
 int flag_log_errors = 0;
 int flag_reconnect_interval_ms = 500;
+placement_t flag_placement = PLACE_LEAST_GROUPS;
+char *flag_hot_restart_sock = NULL;
+int hot_restart_sock = -1;
+char *flag_metrics = NULL;
+int metrics_sock = -1;
+uint64_t loop_iters = 0;
+
+typedef enum {
+  IO_ENGINE_EPOLL = 0,
+  IO_ENGINE_IO_URING,
+} io_engine_t;
+io_engine_t flag_io_engine = IO_ENGINE_EPOLL;
+uint64_t io_pkts = 0; // received, for the packets per CPU second statistic
 
 FILE *urandom;
 
@@ -142,6 +272,324 @@ int epoll_rem(int fd) {
 }
 #endif
 
+#ifdef HAVE_IO_URING
+/*
+  io_uring engine, see uring_run()
+
+  srtla_sock and the SRT sockets each get a single multishot receive, which
+  keeps completing into buffers taken from a provided buffer ring until it's
+  cancelled or runs out of buffers. Receiving a batch of packets thus takes
+  one io_uring_enter() call, instead of an epoll_wait() and a recvfrom() for
+  each. The packets go through the same handlers as with epoll, which still
+  send synchronously. Talks to the kernel directly rather than via liburing
+*/
+#define URING_ENTRIES 256
+#define URING_BUFS    512 // power of 2
+#define URING_BUF_SZ  2048
+#define URING_BGID    0
+
+/* user_data of the requests, (seq << (2 + URING_SLOT_BITS)) | (slot << 2) |
+   kind for the SRT sockets, see uring_arm_srt() */
+#define UD_SRTLA       0
+#define UD_HOT_RESTART 1
+#define UD_CANCEL      2
+#define UD_SRT         3
+#define UD_METRICS     ((1 << 2) | UD_HOT_RESTART) // also a poll
+
+#define URING_SLOT_BITS 8
+#define URING_SLOTS     (1 << URING_SLOT_BITS)
+#if MAX_GROUPS > URING_SLOTS
+#error "URING_SLOT_BITS is too small for MAX_GROUPS"
+#endif
+
+struct {
+  int fd;
+  char *ring; // the SQ and CQ rings share one mapping
+  size_t ring_sz;
+  size_t sqes_sz;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+  unsigned sq_pending; // queued, not yet submitted
+  struct io_uring_buf_ring *br;
+  char *bufs;
+  uint16_t br_tail;
+  struct msghdr srtla_msg; // describes the layout of the srtla_sock buffers
+  uint64_t srt_seq;
+  int armed; // multishot receives in flight
+  int quiescing;
+} uring = {.fd = -1};
+
+int sys_io_uring_enter(unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz) {
+  return syscall(__NR_io_uring_enter, uring.fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+/* Submits the queued requests and waits up to timeout_ms for a completion */
+int uring_enter(int timeout_ms) {
+  struct __kernel_timespec kts = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000LL};
+  struct io_uring_getevents_arg arg = {0};
+  arg.ts = (uint64_t)(uintptr_t)&kts;
+
+  unsigned flags = IORING_ENTER_EXT_ARG;
+  if (timeout_ms >= 0) flags |= IORING_ENTER_GETEVENTS;
+  int ret = sys_io_uring_enter(uring.sq_pending, timeout_ms >= 0 ? 1 : 0, flags, &arg, sizeof(arg));
+  if (ret >= 0) {
+    uring.sq_pending -= min((unsigned)ret, uring.sq_pending);
+  }
+  return ret;
+}
+
+struct io_uring_sqe *uring_get_sqe() {
+  unsigned head = __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE);
+  unsigned tail = *uring.sq_tail;
+  if (tail - head >= URING_ENTRIES) {
+    uring_enter(-1);
+    head = __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head >= URING_ENTRIES) return NULL;
+  }
+
+  unsigned idx = tail & *uring.sq_mask;
+  struct io_uring_sqe *sqe = &uring.sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  uring.sq_array[idx] = idx;
+  __atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+  uring.sq_pending++;
+
+  return sqe;
+}
+
+void uring_buf_recycle(int bid) {
+  struct io_uring_buf *b = &uring.br->bufs[uring.br_tail & (URING_BUFS - 1)];
+  b->addr = (uint64_t)(uintptr_t)(uring.bufs + bid * URING_BUF_SZ);
+  b->len = URING_BUF_SZ;
+  b->bid = bid;
+  uring.br_tail++;
+}
+
+void uring_buf_publish() {
+  __atomic_store_n(&uring.br->tail, uring.br_tail, __ATOMIC_RELEASE);
+}
+
+int uring_arm_recv(int fd, int op, uint64_t ud) {
+  struct io_uring_sqe *sqe = uring_get_sqe();
+  if (sqe == NULL) return -1;
+  sqe->opcode = op;
+  sqe->fd = fd;
+  if (op == IORING_OP_RECVMSG) {
+    sqe->addr = (uint64_t)(uintptr_t)&uring.srtla_msg;
+    sqe->len = 1;
+  }
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BGID;
+  sqe->user_data = ud;
+  uring.armed++;
+
+  return 0;
+}
+
+void uring_cancel(uint64_t ud, int flags) {
+  struct io_uring_sqe *sqe = uring_get_sqe();
+  if (sqe == NULL) return;
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = ud;
+  sqe->cancel_flags = flags;
+  sqe->user_data = UD_CANCEL;
+}
+
+int uring_arm_srtla() {
+  return uring_arm_recv(srtla_sock, IORING_OP_RECVMSG, UD_SRTLA);
+}
+
+/* The receive on each SRT socket carries the slot of its group in
+   uring_srt_groups, so that its completions are matched without searching
+   the groups. As completions can still arrive after the receive has ended
+   and the slot has been reused, they only belong to the slot's group if
+   the whole user_data, with its seq, is that of the group's receive */
+conn_group_t *uring_srt_groups[URING_SLOTS];
+
+void uring_srt_release(conn_group_t *g) {
+  if (g->uring_ud == 0) return;
+  uring_srt_groups[(g->uring_ud >> 2) & (URING_SLOTS - 1)] = NULL;
+  g->uring_ud = 0;
+}
+
+int uring_arm_srt(conn_group_t *g) {
+  uring_srt_release(g);
+
+  int slot = 0;
+  while (slot < URING_SLOTS && uring_srt_groups[slot] != NULL) slot++;
+  if (slot == URING_SLOTS) return -1;
+
+  uint64_t ud = (++uring.srt_seq << (2 + URING_SLOT_BITS)) | ((uint64_t)slot << 2) | UD_SRT;
+  if (uring_arm_recv(g->srt_sock, IORING_OP_RECV, ud) != 0) return -1;
+  g->uring_ud = ud;
+  uring_srt_groups[slot] = g;
+  return 0;
+}
+
+void uring_arm_hot_restart() {
+  if (hot_restart_sock < 0) return;
+  struct io_uring_sqe *sqe = uring_get_sqe();
+  if (sqe == NULL) return;
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = hot_restart_sock;
+  sqe->poll32_events = POLLIN;
+  sqe->user_data = UD_HOT_RESTART;
+}
+
+void uring_arm_metrics() {
+  if (metrics_sock < 0) return;
+  struct io_uring_sqe *sqe = uring_get_sqe();
+  if (sqe == NULL) return;
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = metrics_sock;
+  sqe->poll32_events = POLLIN;
+  sqe->user_data = UD_METRICS;
+}
+
+void uring_free() {
+  if (uring.br) munmap(uring.br, URING_BUFS * sizeof(struct io_uring_buf));
+  if (uring.sqes) munmap(uring.sqes, uring.sqes_sz);
+  if (uring.ring) munmap(uring.ring, uring.ring_sz);
+  free(uring.bufs);
+  if (uring.fd >= 0) close(uring.fd);
+  uring.br = NULL;
+  uring.sqes = NULL;
+  uring.ring = NULL;
+  uring.bufs = NULL;
+  uring.fd = -1;
+}
+
+/* Multishot receives are only supported since Linux 6.0, while the rest of
+   what we use is older: try one out on a throwaway socket */
+int uring_probe_multishot() {
+  int sock = create_udp_socket();
+  if (sock < 0) return -1;
+
+  int ret = -1;
+  if (uring_arm_recv(sock, IORING_OP_RECV, UD_SRT) != 0) goto out;
+  uring_cancel(UD_SRT, 0);
+  uring.armed = 0;
+
+  for (int i = 0; i < 2; i++) {
+    if (uring_enter(1000) < 0) goto out;
+    unsigned head = *uring.cq_head;
+    while (head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe *cqe = &uring.cqes[head & *uring.cq_mask];
+      if (cqe->user_data == UD_SRT) {
+        ret = (cqe->res == -ECANCELED) ? 0 : -1;
+      }
+      head++;
+    }
+    __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+    if (ret == 0) break;
+  }
+
+out:
+  close(sock);
+  return ret;
+}
+
+int uring_init() {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  uring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+  if (uring.fd < 0) return -1;
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) goto err;
+
+  size_t sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  size_t cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  uring.ring_sz = max(sq_sz, cq_sz);
+  char *ring = mmap(NULL, uring.ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    uring.fd, IORING_OFF_SQ_RING);
+  if (ring == MAP_FAILED) goto err;
+  uring.ring = ring;
+  uring.sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+  uring.sqes = mmap(NULL, uring.sqes_sz, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+  if (uring.sqes == MAP_FAILED) {
+    uring.sqes = NULL;
+    goto err;
+  }
+
+  uring.sq_head = (unsigned *)(ring + p.sq_off.head);
+  uring.sq_tail = (unsigned *)(ring + p.sq_off.tail);
+  uring.sq_mask = (unsigned *)(ring + p.sq_off.ring_mask);
+  uring.sq_array = (unsigned *)(ring + p.sq_off.array);
+  uring.cq_head = (unsigned *)(ring + p.cq_off.head);
+  uring.cq_tail = (unsigned *)(ring + p.cq_off.tail);
+  uring.cq_mask = (unsigned *)(ring + p.cq_off.ring_mask);
+  uring.cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+  // The provided buffer ring
+  uring.br = mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (uring.br == MAP_FAILED) {
+    uring.br = NULL;
+    goto err;
+  }
+  uring.bufs = malloc(URING_BUFS * URING_BUF_SZ);
+  if (uring.bufs == NULL) goto err;
+
+  struct io_uring_buf_reg reg = {0};
+  reg.ring_addr = (uint64_t)(uintptr_t)uring.br;
+  reg.ring_entries = URING_BUFS;
+  reg.bgid = URING_BGID;
+  if (syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) goto err;
+  for (int i = 0; i < URING_BUFS; i++) {
+    uring_buf_recycle(i);
+  }
+  uring_buf_publish();
+
+  if (uring_probe_multishot() != 0) goto err;
+
+  uring.srtla_msg.msg_namelen = sizeof(struct sockaddr);
+
+  return 0;
+
+err:
+  uring_free();
+  return -1;
+}
+#endif
+
+/* Start or stop receiving from g->srt_sock with the selected engine */
+int srt_sock_watch(conn_group_t *g) {
+#ifdef HAVE_IO_URING
+  if (flag_io_engine == IO_ENGINE_IO_URING) {
+    return uring_arm_srt(g);
+  }
+#endif
+#ifdef __linux__
+  return epoll_add(g->srt_sock, EPOLLIN, g);
+#else
+  return 0;
+#endif
+}
+
+void srt_sock_close(conn_group_t *g) {
+  if (g->srt_sock < 0) return;
+
+#ifdef HAVE_IO_URING
+  /* Closing the socket doesn't end a receive in flight. Completions that
+     arrive after this are matched to no group and dropped */
+  if (g->uring_ud) {
+    uring_cancel(g->uring_ud, 0);
+    uring_srt_release(g);
+  }
+#endif
+#ifdef __linux__
+  if (flag_io_engine == IO_ENGINE_EPOLL) {
+    epoll_rem(g->srt_sock);
+  }
+#endif
+  close(g->srt_sock);
+  g->srt_sock = -1;
+}
+
 /*
 
 Misc helper functions
@@ -150,7 +598,24 @@ Misc helper functions
 void print_help() {
   fprintf(stderr,
           "Syntax: srtla_rec [-v] SRTLA_LISTEN_PORT SRT_HOST SRT_PORT\n\n"
-          "-v      Print the version and exit\n");
+          "-v      Print the version and exit\n"
+          "--backend HOST:PORT         Add another SRT server to place groups on,\n"
+          "                            can be repeated\n"
+          "--placement least-groups|least-bitrate\n"
+          "                            How new groups are assigned to the SRT\n"
+          "                            servers (default least-groups)\n"
+#ifdef __linux__
+          "--io-engine epoll|io_uring  How packets are received (default epoll),\n"
+          "                            io_uring needs Linux 6.0 or later\n"
+#endif
+#ifndef _WIN32
+          "--hot-restart-sock PATH     Take over the groups and sockets of the\n"
+          "                            srtla_rec listening at PATH, if any, then\n"
+          "                            listen there for the next restart\n"
+#endif
+          "--metrics PATH|[IP:]PORT    Serve Prometheus metrics on a UNIX socket at\n"
+          "                            PATH, or a TCP port (on 127.0.0.1 by default)\n"
+          );
 }
 
 int const_time_cmp(const void *a, const void *b, int len) {
@@ -244,10 +709,30 @@ conn_group_t *group_create(char *sender_id, time_t ts) {
   memcpy(&g->id, id, SRTLA_ID_LEN);
   g->conns = NULL;
   g->srt_sock = -1;
+  g->backend = NULL;
   g->logical_group_id = global_group_seq++;
   g->state = G_ACTIVE;
   g->next_srt_retry_ms = 0;
   g->srt_retry_attempts = 0;
+  g->max_sn = -1;
+  g->reordered_pkts = 0;
+  g->reorder_dist_max = 0;
+  g->reorder_dist_sum = 0;
+  g->caps = 0;
+  g->fec_rx = NULL;
+  for (int i = 0; i < FEC_HELD_MAX; i++) {
+    g->fec_held[i].last = -1;
+  }
+  g->fec_held_cnt = 0;
+  g->fec_recovered = 0;
+  g->fec_unrecoverable = 0;
+  g->uring_ud = 0;
+  g->rcvd_pkts = 0;
+  g->rcvd_bytes = 0;
+  g->fwd_pkts = 0;
+  g->fwd_bytes = 0;
+  g->srt_pkts = 0;
+  g->srt_bytes = 0;
   g->created_at = ts;
   g->next = groups;
   groups = g;
@@ -264,11 +749,12 @@ int group_destroy(conn_group_t *g, conn_group_t **prev_link) {
     c = next;
   }
 
-  if (g->srt_sock > 0) {
-#ifdef __linux__
-    epoll_rem(g->srt_sock);
-#endif
-    close(g->srt_sock);
+  srt_sock_close(g);
+
+  free(g->fec_rx);
+
+  if (g->backend) {
+    g->backend->groups--;
   }
 
   if (prev_link != NULL) {
@@ -301,7 +787,66 @@ int group_count_conns(conn_group_t *g) {
   return count;
 }
 
-int group_reg(struct sockaddr *addr, char *in_buf, time_t ts) {
+/* Returns the group that addr registered with a REG1 and never joined, if
+   the sender's half of its ID matches the first id_len bytes of sender_id */
+conn_group_t *group_find_unused(struct sockaddr *addr, char *sender_id, int id_len) {
+  conn_group_t *g = NULL;
+  conn_t *c;
+  if (group_find_by_addr(addr, &g, &c) != 0) return NULL;
+  if (g->conns != NULL) return NULL;
+  if (const_time_cmp(g->id, sender_id, id_len) != 0) return NULL;
+  return g;
+}
+
+/* srtla_send registers its groups by sending REG1 over all its links at once,
+   with the last byte of its half of the ID varying per address it tried. It
+   then joins the first group it hears back from with all its links. If addr
+   is only blocked by one of the groups it abandoned - no connections and the
+   same sender ID - drop that group rather than wait for it to time out */
+void group_reclaim_addr(struct sockaddr *addr, char *sender_id) {
+  conn_group_t *g = group_find_unused(addr, sender_id, SRTLA_ID_LEN/2 - 1);
+  if (g == NULL) return;
+
+  debug("%s:%d: dropping the unused group #%llu\n", print_addr(addr), port_no(addr),
+        (unsigned long long)g->logical_group_id);
+  group_destroy(g, NULL);
+}
+
+int group_send_reg2(conn_group_t *g, struct sockaddr *addr, int with_caps) {
+  char out_buf[SRTLA_TYPE_REG2_CAPS_LEN];
+  int out_len = SRTLA_TYPE_REG2_LEN;
+  uint16_t header = htobe16(SRTLA_TYPE_REG2);
+  memcpy(out_buf, &header, sizeof(header));
+  memcpy(out_buf + sizeof(header), g->id, SRTLA_ID_LEN);
+
+  /* Only answer with the capabilities we accept if the sender offered some,
+     older senders expect a fixed size REG2 */
+  if (with_caps) {
+    uint32_t caps = htobe32(g->caps);
+    memcpy(out_buf + SRTLA_TYPE_REG2_LEN, &caps, sizeof(caps));
+    out_len = SRTLA_TYPE_REG2_CAPS_LEN;
+  }
+
+  int ret = SENDTO(srtla_sock, out_buf, out_len, 0, addr, addr_len);
+  return (ret == out_len) ? 0 : -1;
+}
+
+int group_reg(struct sockaddr *addr, char *in_buf, int len, time_t ts) {
+  char *id = in_buf + 2;
+  int with_caps = (len == SRTLA_TYPE_REG1_CAPS_LEN);
+  uint16_t header;
+
+  /* A REG1 retried from the same address can cross our REG2 for the previous
+     one. Answer it with the same group, so that whichever REG2 reaches the
+     sender first is still valid */
+  conn_group_t *g = group_find_unused(addr, id, SRTLA_ID_LEN/2);
+  if (g != NULL && ts < g->created_at + GROUP_REG2_WAIT) {
+    if (group_send_reg2(g, addr, with_caps) != 0) goto err;
+    debug("%s:%d: group #%llu registered again\n", print_addr(addr), port_no(addr),
+          (unsigned long long)g->logical_group_id);
+    return 0;
+  }
+
   if (group_count >= MAX_GROUPS) {
     err("%s:%d: group count is %d, rejecting group registration\n",
         print_addr(addr), port_no(addr), group_count);
@@ -309,13 +854,12 @@ int group_reg(struct sockaddr *addr, char *in_buf, time_t ts) {
   }
 
   // If this remote address is already registered, abort
-  conn_group_t *g = NULL;
   conn_t *c;
+  group_reclaim_addr(addr, id);
   int ret = group_find_by_addr(addr, &g, &c);
   if (ret != -1) goto err;
 
   // Allocate the group
-  char *id = in_buf + 2;
   g = group_create(id, ts);
   if (g == NULL) goto err;
 
@@ -323,15 +867,21 @@ int group_reg(struct sockaddr *addr, char *in_buf, time_t ts) {
      It won't be allowed to register another group while this one is active */
   g->last_addr = *addr;
 
-  // Build a REG2 packet
-  char out_buf[SRTLA_TYPE_REG2_LEN];
-  uint16_t header = htobe16(SRTLA_TYPE_REG2);
-  memcpy(out_buf, &header, sizeof(header));
-  memcpy(out_buf + sizeof(header), g->id, SRTLA_ID_LEN);
+  if (with_caps) {
+    uint32_t caps;
+    memcpy(&caps, in_buf + SRTLA_TYPE_REG1_LEN, sizeof(caps));
+    g->caps = be32toh(caps) & SRTLA_SUPPORTED_CAPS;
 
-  // Send the REG2 packet
-  ret = SENDTO(srtla_sock, out_buf, sizeof(out_buf), 0, addr, addr_len);
-  if (ret != sizeof(out_buf)) goto err_destroy;
+    if (g->caps & SRTLA_CAP_FEC) {
+      g->fec_rx = malloc(sizeof(fec_rx_pkt_t) * FEC_RX_WINDOW);
+      if (g->fec_rx == NULL) goto err_destroy;
+      for (int i = 0; i < FEC_RX_WINDOW; i++) {
+        g->fec_rx[i].sn = -1;
+      }
+    }
+  }
+
+  if (group_send_reg2(g, addr, with_caps) != 0) goto err_destroy;
 
   info("%s:%d: group #%llu registered\n", print_addr(addr), port_no(addr), (unsigned long long)g->logical_group_id);
 
@@ -342,6 +892,7 @@ int group_reg(struct sockaddr *addr, char *in_buf, time_t ts) {
 
 err_destroy:
   groups = g->next;
+  free(g->fec_rx);
   free(g);
 
 err:
@@ -365,6 +916,9 @@ int conn_reg(struct sockaddr *addr, char *in_buf, time_t ts) {
 
   /* If the connection is already registered, we'll allow it to register
      again to the same group, but not to a new one */
+  if (group_find_by_addr(addr, &tmp, &c) == 0 && tmp != g) {
+    group_reclaim_addr(addr, id);
+  }
   int ret = group_find_by_addr(addr, &tmp, &c);
   if (ret != -1 && tmp != g) goto err;
 
@@ -382,6 +936,10 @@ int conn_reg(struct sockaddr *addr, char *in_buf, time_t ts) {
     c->addr = *addr;
     c->recv_idx = 0;
     c->last_rcvd = ts;
+    c->rcvd_pkts = 0;
+    c->rcvd_bytes = 0;
+    c->keepalives = 0;
+    c->acks_sent = 0;
     c->next = g->conns;
     g->conns = c;
   }
@@ -421,37 +979,206 @@ Resource limits:
 
 */
 
-void handle_srt_data(conn_group_t *g) {
-  char buf[MTU];
+/*
+  SRT backends
+
+  Each group is forwarded to one of the SRT servers given with the positional
+  arguments and --backend, chosen when its SRT socket is first opened: the
+  healthy backend with the fewest groups, or with --placement least-bitrate,
+  the one currently receiving the least data. With more than one backend,
+  each one is sent an SRT handshake induction every BACKEND_CHECK_INT, and
+  marked down after BACKEND_FAIL_MAX unanswered ones. Groups waiting for a
+  backend that's down are moved to a healthy one. The SRT session itself
+  can't move, the sender's SRT reconnects through the new backend
+*/
+int backend_better(srt_backend_t *a, srt_backend_t *b) {
+  if (a->healthy != b->healthy) return a->healthy;
+  if (flag_placement == PLACE_LEAST_BITRATE && a->bitrate != b->bitrate) {
+    return a->bitrate < b->bitrate;
+  }
+  return a->groups < b->groups;
+}
 
-  if (g == NULL) return;
+srt_backend_t *backend_select() {
+  srt_backend_t *best = NULL;
+  for (srt_backend_t *b = backends; b != NULL; b = b->next) {
+    if (best == NULL || backend_better(b, best)) {
+      best = b;
+    }
+  }
+  return best;
+}
 
-  int n = RECV(g->srt_sock, &buf, MTU, 0);
-  if (n < SRT_MIN_LEN) {
-    int e = errno;
-    if (flag_log_errors) err("Group #%llu (ptr=%p): SRT read failed (err=%s). Entering WAITING_SRT\n", (unsigned long long)g->logical_group_id, g, sock_err_str());
-    else err("Group %p: failed to read the SRT sock, entering WAITING_SRT\n", g);
-    // Close socket and mark for retry rather than destroying the whole group
-    if (g->srt_sock > 0) { close(g->srt_sock); }
-    g->srt_sock = -1;
-    if (flag_auto_reconnect) {
-      g->state = G_WAITING_SRT;
-      g->srt_retry_attempts++;
-      g->next_srt_retry_ms = time(NULL) * 1000 + flag_reconnect_interval_ms * (1 << (g->srt_retry_attempts - 1));
-      if (g->next_srt_retry_ms - (time(NULL)*1000) > REG_RETRY_MAX_MS) {
-        g->next_srt_retry_ms = time(NULL)*1000 + REG_RETRY_MAX_MS;
-      }
-    } else {
-      group_destroy(g, NULL);
+void group_place(conn_group_t *g) {
+  srt_backend_t *b = backend_select();
+  if (b == g->backend) return;
+
+  if (g->backend) {
+    g->backend->groups--;
+    info("Group #%llu: moving from SRT backend %s:%d to %s:%d\n",
+         (unsigned long long)g->logical_group_id,
+         print_addr(&g->backend->addr), port_no(&g->backend->addr),
+         print_addr(&b->addr), port_no(&b->addr));
+  } else if (backend_count > 1) {
+    info("Group #%llu: assigned to SRT backend %s:%d\n",
+         (unsigned long long)g->logical_group_id, print_addr(&b->addr), port_no(&b->addr));
+  }
+  g->backend = b;
+  b->groups++;
+}
+
+srt_handshake_t srt_induction_pkt() {
+  srt_handshake_t hs_packet = {0};
+  hs_packet.header.type = htobe16(SRT_TYPE_HANDSHAKE);
+  hs_packet.version = htobe32(4);
+  hs_packet.ext_field = htobe16(2);
+  hs_packet.handshake_type = htobe32(1);
+  return hs_packet;
+}
+
+int sock_readable(int fd) {
+  fd_set fds;
+  FD_ZERO(&fds);
+  FD_SET(fd, &fds);
+  struct timeval to = {0, 0};
+  return select(fd + 1, &fds, NULL, NULL, &to) > 0;
+}
+
+void backend_set_health(srt_backend_t *b, int healthy) {
+  if (b->healthy == healthy) return;
+  b->healthy = healthy;
+  if (healthy) {
+    info("SRT backend %s:%d is reachable again\n", print_addr(&b->addr), port_no(&b->addr));
+  } else {
+    err("SRT backend %s:%d is not responding, placing new groups elsewhere\n",
+        print_addr(&b->addr), port_no(&b->addr));
+  }
+}
+
+void backend_check(srt_backend_t *b) {
+  if (b->check_sock < 0) {
+    b->check_sock = create_udp_socket();
+    if (b->check_sock < 0) return;
+    if (connect(b->check_sock, &b->addr, addr_len) != 0) {
+      close(b->check_sock);
+      b->check_sock = -1;
+      return;
     }
-    return;
   }
 
+  // Any reply to the previous induction?
+  int answered = 0;
+  while (sock_readable(b->check_sock)) {
+    char buf[MTU];
+    int r = RECV(b->check_sock, buf, MTU, 0);
+    if (r == sizeof(srt_handshake_t)) {
+      answered = 1;
+    } else if (r < 0) {
+      break; // e.g. ICMP port unreachable
+    }
+  }
+
+  if (answered) {
+    b->check_fails = 0;
+    backend_set_health(b, 1);
+  } else if (++b->check_fails >= BACKEND_FAIL_MAX) {
+    backend_set_health(b, 0);
+  }
+
+  srt_handshake_t hs_packet = srt_induction_pkt();
+  send(b->check_sock, (const char*)&hs_packet, sizeof(hs_packet), 0);
+}
+
+void backend_probe_done(srt_backend_t *b) {
+  for (int i = 0; i < b->probe_cnt; i++) {
+    close(b->probe_socks[i]);
+  }
+  b->probe_cnt = 0;
+  backends_probing--;
+
+  // The health checks were sent to the provisional address
+  if (b->check_sock >= 0) {
+    close(b->check_sock);
+    b->check_sock = -1;
+  }
+}
+
+void backend_probe_poll(srt_backend_t *b, uint64_t ms) {
+  for (int i = 0; i < b->probe_cnt; i++) {
+    if (!sock_readable(b->probe_socks[i])) continue;
+
+    char buf[MTU];
+    int ret = RECV(b->probe_socks[i], buf, MTU, 0);
+    if (ret == sizeof(srt_handshake_t)) {
+      b->addr = b->probe_addrs[i];
+      b->healthy = 1;
+      info("SRT at %s:%d is reachable, using it\n", print_addr(&b->addr), port_no(&b->addr));
+      backend_probe_done(b);
+      return;
+    }
+  }
+
+  if (ms >= b->probe_deadline) {
+    fprintf(stderr, "WARNING: Failed to confirm that a SRT server is reachable at any address\n"
+                    "Proceeding with the first address %s\n", print_addr(&b->addr));
+    backend_probe_done(b);
+  }
+}
+
+void backends_tick(uint64_t ms) {
+  if (backends_probing) {
+    for (srt_backend_t *b = backends; b != NULL; b = b->next) {
+      if (b->probe_cnt) backend_probe_poll(b, ms);
+    }
+  }
+
+  static uint64_t last_ran = 0;
+  if (last_ran + BACKEND_CHECK_INT * 1000 > ms) return;
+  uint64_t elapsed = last_ran ? ms - last_ran : BACKEND_CHECK_INT * 1000;
+  last_ran = ms;
+
+  for (srt_backend_t *b = backends; b != NULL; b = b->next) {
+    int64_t rate = b->bytes * 1000 / (int64_t)elapsed;
+    b->bitrate = b->bitrate ? (3 * b->bitrate + rate) / 4 : rate;
+    b->bytes = 0;
+
+    if (backend_count > 1 && b->probe_cnt == 0) {
+      backend_check(b);
+    }
+  }
+}
+
+void handle_srt_read_failure(conn_group_t *g) {
+  int e = errno;
+  if (flag_log_errors) err("Group #%llu (ptr=%p): SRT read failed (err=%s). Entering WAITING_SRT\n", (unsigned long long)g->logical_group_id, g, sock_err_str());
+  else err("Group %p: failed to read the SRT sock, entering WAITING_SRT\n", g);
+  // Close socket and mark for retry rather than destroying the whole group
+  srt_sock_close(g);
+  if (flag_auto_reconnect) {
+    g->state = G_WAITING_SRT;
+    g->srt_retry_attempts++;
+    g->next_srt_retry_ms = time(NULL) * 1000 + flag_reconnect_interval_ms * (1 << (g->srt_retry_attempts - 1));
+    if (g->next_srt_retry_ms - (time(NULL)*1000) > REG_RETRY_MAX_MS) {
+      g->next_srt_retry_ms = time(NULL)*1000 + REG_RETRY_MAX_MS;
+    }
+  } else {
+    group_destroy(g, NULL);
+  }
+}
+
+void handle_srt_pkt(conn_group_t *g, char *buf, int n) {
+  io_pkts++;
+
+  pkt_desc_t d;
+  pkt_parse(&d, buf, n);
+  g->srt_pkts++;
+  g->srt_bytes += n;
+
   // ACK
-  if (is_srt_ack(buf, n)) {
+  if (d.type == PKT_T_SRT_ACK) {
     // Broadcast SRT ACKs over all connections for timely delivery
     for (conn_t *c = g->conns; c != NULL; c = c->next) {
-      int ret = SENDTO(srtla_sock, &buf, n, 0, &c->addr, addr_len);
+      int ret = SENDTO(srtla_sock, buf, n, 0, &c->addr, addr_len);
       if (ret != n) {
     if (flag_log_errors) err("%s:%d (group #%llu): failed to send the SRT ack (ret=%d, err=%s)\n",
       print_addr(&c->addr), port_no(&c->addr), (unsigned long long)g->logical_group_id, ret, sock_err_str());
@@ -461,7 +1188,7 @@ void handle_srt_data(conn_group_t *g) {
     }
   } else {
     // send other packets over the most recently used SRTLA connection
-    int ret = SENDTO(srtla_sock, &buf, n, 0, &g->last_addr, addr_len);
+    int ret = SENDTO(srtla_sock, buf, n, 0, &g->last_addr, addr_len);
     if (ret != n) {
       int serr = errno;
       if (flag_log_errors) err("%s:%d (group #%llu): failed to send the SRT packet (ret=%d, err=%s)\n",
@@ -484,6 +1211,24 @@ void handle_srt_data(conn_group_t *g) {
   }
 }
 
+void handle_srt_data(conn_group_t *g) {
+  if (g == NULL) return;
+
+  pkt_buf_t *pkt = pkt_buf_alloc();
+  if (pkt == NULL) return;
+
+  int n = RECV(g->srt_sock, pkt->data, MTU, 0);
+  if (n < SRT_MIN_LEN) {
+    pkt_buf_unref(pkt);
+    handle_srt_read_failure(g);
+    return;
+  }
+
+  // ACKs are sent to every connection straight from this buffer
+  handle_srt_pkt(g, pkt->data, n);
+  pkt_buf_unref(pkt);
+}
+
 void register_packet(conn_group_t *g, conn_t *c, int32_t sn) {
   // store the sequence numbers in BE, as they're transmitted over the network
   c->recv_log[c->recv_idx++] = htobe32(sn);
@@ -497,69 +1242,303 @@ void register_packet(conn_group_t *g, conn_t *c, int32_t sn) {
     if (ret != sizeof(ack)) {
       err("%s:%d (group %p): failed to send the srtla ack\n",
           print_addr(&c->addr), port_no(&c->addr), g);
+    } else {
+      c->acks_sent++;
     }
 
     c->recv_idx = 0;
   }
 }
 
-void handle_srtla_data(time_t ts) {
-  char buf[MTU];
-  int ret;
-
-  // Get the packet
-  struct sockaddr srtla_addr;
-  socklen_t len = addr_len;
-  int n = recvfrom(srtla_sock, buf, MTU, 0, &srtla_addr, &len);
-  if (n < 0) {
-    err("Failed to read a srtla packet\n");
-    return;
-  }
-
-  // Handle srtla registration packets
-  if (is_srtla_reg1(buf, n)) {
-    group_reg(&srtla_addr, buf, ts);
+/* Tracks how far out of order the data packets arrive over the bonded links.
+   Sequence numbers are 31 bit, so differences are computed modulo 2^31 */
+void group_track_reorder(conn_group_t *g, int32_t sn) {
+  if (g->max_sn < 0) {
+    g->max_sn = sn;
     return;
   }
 
-  if (is_srtla_reg2(buf, n)) {
-    conn_reg(&srtla_addr, buf, ts);
-    return;
+  int32_t dist = (g->max_sn - sn) & 0x7FFFFFFF;
+  if (dist == 0) return;
+  if (dist < 0x40000000) {
+    g->reordered_pkts++;
+    g->reorder_dist_sum += dist;
+    g->reorder_dist_max = max(g->reorder_dist_max, dist);
+  } else {
+    g->max_sn = sn;
   }
+}
 
-  // Check that the peer is a member of a connection group, discard otherwise
-  conn_t *c;
-  conn_group_t *g;
-  ret = group_find_by_addr(&srtla_addr, &g, &c);
-  if (ret != 1) return;
+/*
+  FEC recovery: the data packets of groups that negotiated SRTLA_CAP_FEC are
+  kept in a small window. When a parity packet arrives and exactly one of
+  the data packets it protects is missing, that packet is rebuilt by XORing
+  the parity with the others and forwarded to SRT
+
+  The parity often overtakes the last packets of its group when those went
+  over a slower link, so rather than rebuilding a packet that is still in
+  flight, the parity is held back until the highest received sequence
+  number has moved past the newest packet it protects by more than the
+  largest reorder distance seen so far, or for at most FEC_HOLD_MS. A
+  packet that still arrives after having been rebuilt is dropped, so SRT
+  doesn't get it twice
+*/
+void fec_store(conn_group_t *g, int32_t sn, char *buf, int n) {
+  fec_rx_pkt_t *p = &g->fec_rx[sn % FEC_RX_WINDOW];
+  p->sn = sn;
+  p->len = n;
+  p->rebuilt = 0;
+  memcpy(p->buf, buf, n);
+}
 
-  // Update the connection's use timestamp
-  c->last_rcvd = ts;
+int fec_have(conn_group_t *g, int32_t sn) {
+  return g->fec_rx[sn % FEC_RX_WINDOW].sn == sn;
+}
 
-  // Resend SRTLA keep-alive packets to the sender
-  if (is_srtla_keepalive(buf, n)) {
-    int ret = SENDTO(srtla_sock, &buf, n, 0, &srtla_addr, addr_len);
-    if (ret != n) {
-      err("%s:%d (group %p): failed to send the srtla keepalive\n",
-          print_addr(&srtla_addr), port_no(&srtla_addr), g);
+/* Returns the only packet protected by the parity that hasn't been received,
+   -1 if there's none or the parity is malformed, -2 if several are missing.
+   Sets *len to the length of the missing packet */
+int32_t fec_missing(conn_group_t *g, char *buf, int n, uint16_t *len) {
+  if (n < (int)sizeof(srtla_fec_header_t)) return -1;
+
+  srtla_fec_header_t *hdr = (srtla_fec_header_t *)buf;
+  int k = hdr->k;
+  if (k < 1 || k > FEC_MAX_K || n <= SRTLA_FEC_HDR_LEN(k)) return -1;
+
+  int32_t missing = -1;
+  int missing_cnt = 0;
+  *len = be16toh(hdr->len_xor);
+  for (int i = 0; i < k; i++) {
+    uint32_t sn_be;
+    memcpy(&sn_be, &hdr->sns[i], sizeof(sn_be));
+    int32_t sn = be32toh(sn_be) & 0x7FFFFFFF;
+    if (fec_have(g, sn)) {
+      *len ^= g->fec_rx[sn % FEC_RX_WINDOW].len;
+    } else {
+      missing = sn;
+      missing_cnt++;
     }
-    return;
   }
 
-  // Check that the packet is large enough to be an SRT packet, discard otherwise
+  return (missing_cnt > 1) ? -2 : missing;
+}
+
+/* Whether the packets up to sn that are still missing can be assumed lost
+   rather than late */
+int fec_settled(conn_group_t *g, int32_t sn) {
+  int32_t dist = (g->max_sn - sn) & 0x7FFFFFFF;
+  // The other packets of the FEC group must still be in the window
+  int reorder_dist = min(g->reorder_dist_max, FEC_RX_WINDOW / 2);
+  return dist < 0x40000000 && dist > reorder_dist;
+}
+
+void fec_rebuild(conn_group_t *g, char *buf, int n, int32_t missing, uint16_t len) {
+  srtla_fec_header_t *hdr = (srtla_fec_header_t *)buf;
+  int k = hdr->k;
+  int hdr_len = SRTLA_FEC_HDR_LEN(k);
+  int parity_len = n - hdr_len;
+  if (len < SRT_MIN_LEN || len > parity_len) return;
+
+  char out[MTU];
+  memcpy(out, buf + hdr_len, parity_len);
+  for (int i = 0; i < k; i++) {
+    uint32_t sn_be;
+    memcpy(&sn_be, &hdr->sns[i], sizeof(sn_be));
+    int32_t sn = be32toh(sn_be) & 0x7FFFFFFF;
+    if (sn == missing) continue;
+
+    fec_rx_pkt_t *p = &g->fec_rx[sn % FEC_RX_WINDOW];
+    for (int j = 0; j < p->len; j++) {
+      out[j] ^= p->buf[j];
+    }
+  }
+
+  // Sanity check: the rebuilt packet must be the one we were missing
+  if (get_srt_sn(out, len) != missing) return;
+
+  fec_store(g, missing, out, len);
+  g->fec_recovered++;
+  debug("Group #%llu: recovered packet %d with FEC\n",
+        (unsigned long long)g->logical_group_id, missing);
+
+  if (g->srt_sock < 0) return;
+  int ret = send(g->srt_sock, out, len, 0);
+  if (ret != len) {
+    err("Group #%llu: failed to forward packet %d recovered with FEC\n",
+        (unsigned long long)g->logical_group_id, missing);
+    return;
+  }
+  g->fec_rx[missing % FEC_RX_WINDOW].rebuilt = 1;
+  g->backend->bytes += len;
+  g->fwd_pkts++;
+  g->fwd_bytes += len;
+}
+
+void fec_apply(conn_group_t *g, char *buf, int n) {
+  uint16_t len;
+  int32_t missing = fec_missing(g, buf, n, &len);
+  if (missing == -2) {
+    g->fec_unrecoverable++;
+  } else if (missing >= 0) {
+    fec_rebuild(g, buf, n, missing, len);
+  }
+}
+
+void fec_release(conn_group_t *g, fec_held_t *h) {
+  h->last = -1;
+  g->fec_held_cnt--;
+}
+
+/* Applies the held parities once the reordering has settled, and drops the
+   ones whose packets have all arrived after all. ms is the current time, or
+   0 to only look it up if needed */
+void fec_release_held(conn_group_t *g, uint64_t ms) {
+  for (int i = 0; i < FEC_HELD_MAX && g->fec_held_cnt > 0; i++) {
+    fec_held_t *h = &g->fec_held[i];
+    if (h->last < 0) continue;
+
+    uint16_t len;
+    if (fec_missing(g, h->buf, h->len, &len) == -1) {
+      fec_release(g, h);
+      continue;
+    }
+    if (!fec_settled(g, h->last)) {
+      if (ms == 0 && get_ms(&ms) != 0) continue;
+      if (ms < h->deadline) continue;
+    }
+    fec_apply(g, h->buf, h->len);
+    fec_release(g, h);
+  }
+}
+
+void fec_hold(conn_group_t *g, int32_t last, char *buf, int n) {
+  uint64_t ms = 0;
+  get_ms(&ms);
+
+  // Out of slots, give the oldest parity its chance right away
+  fec_held_t *h = NULL;
+  for (int i = 0; i < FEC_HELD_MAX; i++) {
+    fec_held_t *cur = &g->fec_held[i];
+    if (cur->last < 0) {
+      h = cur;
+      break;
+    }
+    if (h == NULL || cur->deadline < h->deadline) h = cur;
+  }
+  if (h->last >= 0) {
+    fec_apply(g, h->buf, h->len);
+    fec_release(g, h);
+  }
+
+  h->last = last;
+  h->len = n;
+  h->deadline = ms + FEC_HOLD_MS;
+  memcpy(h->buf, buf, n);
+  g->fec_held_cnt++;
+}
+
+void handle_fec(conn_group_t *g, char *buf, int n) {
+  if (g->fec_rx == NULL) return;
+
+  uint16_t len;
+  if (fec_missing(g, buf, n, &len) == -1) return;
+
+  // The packets are listed in the order they were sent
+  srtla_fec_header_t *hdr = (srtla_fec_header_t *)buf;
+  uint32_t sn_be;
+  memcpy(&sn_be, &hdr->sns[hdr->k - 1], sizeof(sn_be));
+  int32_t last = be32toh(sn_be) & 0x7FFFFFFF;
+
+  if (fec_settled(g, last)) {
+    fec_apply(g, buf, n);
+  } else {
+    fec_hold(g, last, buf, n);
+  }
+}
+
+void fec_tick(uint64_t ms) {
+  for (conn_group_t *g = groups; g != NULL; g = g->next) {
+    if (g->fec_held_cnt > 0) fec_release_held(g, ms);
+  }
+}
+
+void handle_srtla_pkt(char *buf, int n, struct sockaddr srtla_addr, time_t ts) {
+  int ret;
+  io_pkts++;
+
+  pkt_desc_t d;
+  pkt_parse(&d, buf, n);
+
+  // Handle srtla registration packets
+  if (d.type == PKT_T_SRTLA_REG1) {
+    group_reg(&srtla_addr, buf, n, ts);
+    return;
+  }
+
+  if (d.type == PKT_T_SRTLA_REG2) {
+    conn_reg(&srtla_addr, buf, ts);
+    return;
+  }
+
+  // Check that the peer is a member of a connection group, discard otherwise
+  conn_t *c;
+  conn_group_t *g;
+  ret = group_find_by_addr(&srtla_addr, &g, &c);
+  if (ret != 1) return;
+
+  // Update the connection's use timestamp
+  c->last_rcvd = ts;
+  c->rcvd_pkts++;
+  c->rcvd_bytes += n;
+  g->rcvd_pkts++;
+  g->rcvd_bytes += n;
+
+  // Resend SRTLA keep-alive packets to the sender
+  if (d.type == PKT_T_SRTLA_KEEPALIVE) {
+    c->keepalives++;
+    int ret = SENDTO(srtla_sock, buf, n, 0, &srtla_addr, addr_len);
+    if (ret != n) {
+      err("%s:%d (group %p): failed to send the srtla keepalive\n",
+          print_addr(&srtla_addr), port_no(&srtla_addr), g);
+    }
+    return;
+  }
+
+  // FEC parity packets are consumed here, they're not SRT packets
+  if (d.type == PKT_T_SRTLA_FEC) {
+    handle_fec(g, buf, n);
+    return;
+  }
+
+  // Only SRT packets are forwarded, discard malformed and other srtla ones
+  if (d.type == PKT_T_INVALID || d.type > PKT_T_SRT_CONTROL) return;
+
+  // Check that the packet is large enough to be an SRT packet, discard otherwise
   if (n < SRT_MIN_LEN) return;
 
   // Record the most recently active peer
   g->last_addr = srtla_addr;
 
   // Keep track of the received data packets to send SRTLA ACKs
-  int32_t sn = get_srt_sn(buf, n);
+  int32_t sn = d.sn;
   if (sn >= 0) {
     register_packet(g, c, sn);
+    group_track_reorder(g, sn);
+    if (g->fec_rx) {
+      // Already rebuilt from the parity and forwarded
+      if (fec_have(g, sn) && g->fec_rx[sn % FEC_RX_WINDOW].rebuilt) return;
+
+      fec_store(g, sn, buf, n);
+      if (g->fec_held_cnt > 0) fec_release_held(g, 0);
+    }
   }
 
   // Open a connection to the SRT server for the group
   if (g->srt_sock < 0) {
+    if (g->backend == NULL || !g->backend->healthy) {
+      group_place(g);
+    }
+
     int sock = create_udp_socket();
     if (sock < 0) {
       err("Group #%llu: failed to create an SRT socket (%s)\n", (unsigned long long)g->logical_group_id, sock_err_str());
@@ -576,7 +1555,7 @@ void handle_srtla_data(time_t ts) {
     }
     g->srt_sock = sock;
 
-    int ret = connect(sock, &srt_addr, addr_len);
+    int ret = connect(sock, &g->backend->addr, addr_len);
     if (ret != 0) {
       err("Group #%llu: failed to connect() the SRT socket (%s)\n", (unsigned long long)g->logical_group_id, sock_err_str());
       close(sock);
@@ -594,7 +1573,7 @@ void handle_srtla_data(time_t ts) {
     }
 
 #ifdef __linux__
-    ret = epoll_add(sock, EPOLLIN, g);
+    ret = srt_sock_watch(g);
     if (ret < 0) {
       err("Group #%llu: failed to add the SRT socket to the epoll\n", (unsigned long long)g->logical_group_id);
       close(sock);
@@ -615,7 +1594,274 @@ void handle_srtla_data(time_t ts) {
   if (ret != n) {
     err("Group %p: failed to forward the srtla packet, terminating the group\n", g);
     group_destroy(g, NULL);
+    return;
+  }
+  g->backend->bytes += n;
+  g->fwd_pkts++;
+  g->fwd_bytes += n;
+}
+
+void handle_srtla_data(time_t ts) {
+  pkt_buf_t *pkt = pkt_buf_alloc();
+  if (pkt == NULL) return;
+
+  // Get the packet
+  struct sockaddr srtla_addr;
+  socklen_t len = addr_len;
+  int n = RECVFROM(srtla_sock, pkt->data, MTU, 0, &srtla_addr, &len);
+  if (n < 0) {
+    err("Failed to read a srtla packet\n");
+  } else {
+    handle_srtla_pkt(pkt->data, n, srtla_addr, ts);
+  }
+  pkt_buf_unref(pkt);
+}
+
+const char *io_engine_name() {
+#ifdef __linux__
+  return (flag_io_engine == IO_ENGINE_IO_URING) ? "io_uring" : "epoll";
+#else
+  return "select";
+#endif
+}
+
+/* Packets received per second of CPU time since the last report, to compare
+   the I/O engines under the same load */
+void io_stats_report() {
+#if !defined(_WIN32) && LOG_LEVEL >= LOG_DEBUG
+  static uint64_t last_pkts = 0;
+  static int64_t last_cpu_us = 0;
+
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) != 0) return;
+  int64_t cpu_us = (int64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+                   ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+
+  uint64_t pkts = io_pkts - last_pkts;
+  int64_t used_us = cpu_us - last_cpu_us;
+  last_pkts = io_pkts;
+  last_cpu_us = cpu_us;
+
+  debug("I/O engine %s: %llu packets in %lld ms of CPU time, %lld packets per CPU second\n",
+        io_engine_name(), (unsigned long long)pkts, (long long)(used_us / 1000),
+        used_us > 0 ? (long long)(pkts * 1000000 / used_us) : 0LL);
+#endif
+}
+
+/*
+  Metrics endpoint
+
+  With --metrics PATH|[IP:]PORT, the groups, their conns and the counters
+  below are served in the Prometheus text format, see metrics_serve(). The
+  event loop is the counters' only writer, and they're only summed up when
+  scraped. The socket isn't handed over during a hot restart: the old
+  process closes it, and the new one opens its own
+*/
+typedef enum {
+  GM_CONNS = 0,
+  GM_RCVD_PKTS,
+  GM_RCVD_BYTES,
+  GM_FWD_PKTS,
+  GM_FWD_BYTES,
+  GM_SRT_PKTS,
+  GM_SRT_BYTES,
+  GM_REORDERED,
+  GM_REORDER_MAX,
+  GM_FEC_RECOVERED,
+  GM_FEC_UNRECOVERABLE,
+  GM_CNT
+} group_metric_t;
+
+const metric_desc_t group_metrics[GM_CNT] = {
+  [GM_CONNS] = {"srtla_rec_group_connections", "gauge",
+    "Connections of the group"},
+  [GM_RCVD_PKTS] = {"srtla_rec_group_received_packets_total", "counter",
+    "Packets received from the sender over all the connections"},
+  [GM_RCVD_BYTES] = {"srtla_rec_group_received_bytes_total", "counter",
+    "Bytes received from the sender over all the connections"},
+  [GM_FWD_PKTS] = {"srtla_rec_group_forwarded_packets_total", "counter",
+    "Packets forwarded to the SRT server"},
+  [GM_FWD_BYTES] = {"srtla_rec_group_forwarded_bytes_total", "counter",
+    "Bytes forwarded to the SRT server"},
+  [GM_SRT_PKTS] = {"srtla_rec_group_srt_packets_total", "counter",
+    "Packets received from the SRT server"},
+  [GM_SRT_BYTES] = {"srtla_rec_group_srt_bytes_total", "counter",
+    "Bytes received from the SRT server"},
+  [GM_REORDERED] = {"srtla_rec_group_reordered_packets_total", "counter",
+    "Data packets that arrived out of order"},
+  [GM_REORDER_MAX] = {"srtla_rec_group_reorder_distance_max", "gauge",
+    "Largest reordering distance, in packets"},
+  [GM_FEC_RECOVERED] = {"srtla_rec_group_fec_recovered_total", "counter",
+    "Lost packets recovered with FEC"},
+  [GM_FEC_UNRECOVERABLE] = {"srtla_rec_group_fec_unrecoverable_total", "counter",
+    "Losses FEC couldn't recover"},
+};
+
+double group_metric(conn_group_t *g, group_metric_t metric) {
+  switch (metric) {
+    case GM_CONNS: return group_count_conns(g);
+    case GM_RCVD_PKTS: return g->rcvd_pkts;
+    case GM_RCVD_BYTES: return g->rcvd_bytes;
+    case GM_FWD_PKTS: return g->fwd_pkts;
+    case GM_FWD_BYTES: return g->fwd_bytes;
+    case GM_SRT_PKTS: return g->srt_pkts;
+    case GM_SRT_BYTES: return g->srt_bytes;
+    case GM_REORDERED: return g->reordered_pkts;
+    case GM_REORDER_MAX: return g->reorder_dist_max;
+    case GM_FEC_RECOVERED: return g->fec_recovered;
+    case GM_FEC_UNRECOVERABLE: return g->fec_unrecoverable;
+    default: return 0;
+  }
+}
+
+typedef enum {
+  CM_RCVD_PKTS = 0,
+  CM_RCVD_BYTES,
+  CM_KEEPALIVES,
+  CM_ACKS_SENT,
+  CM_IDLE,
+  CM_CNT
+} conn_metric_t;
+
+const metric_desc_t conn_metrics[CM_CNT] = {
+  [CM_RCVD_PKTS] = {"srtla_rec_conn_received_packets_total", "counter",
+    "Packets received over the connection"},
+  [CM_RCVD_BYTES] = {"srtla_rec_conn_received_bytes_total", "counter",
+    "Bytes received over the connection"},
+  [CM_KEEPALIVES] = {"srtla_rec_conn_keepalives_total", "counter",
+    "Keepalives received and echoed back"},
+  [CM_ACKS_SENT] = {"srtla_rec_conn_acks_sent_total", "counter",
+    "SRTLA ACKs sent over the connection"},
+  [CM_IDLE] = {"srtla_rec_conn_idle_seconds", "gauge",
+    "Time since the last packet received over the connection"},
+};
+
+double conn_metric(conn_t *c, conn_metric_t metric, time_t ts) {
+  switch (metric) {
+    case CM_RCVD_PKTS: return c->rcvd_pkts;
+    case CM_RCVD_BYTES: return c->rcvd_bytes;
+    case CM_KEEPALIVES: return c->keepalives;
+    case CM_ACKS_SENT: return c->acks_sent;
+    case CM_IDLE: return ts - c->last_rcvd;
+    default: return 0;
+  }
+}
+
+void metrics_fill(metrics_buf_t *m) {
+  time_t ts;
+  get_seconds(&ts);
+
+  for (int i = 0; i < GM_CNT; i++) {
+    metrics_family(m, &group_metrics[i]);
+    for (conn_group_t *g = groups; g != NULL; g = g->next) {
+      metrics_printf(m, "%s{group=\"%llu\"} %.15g\n", group_metrics[i].name,
+                     (unsigned long long)g->logical_group_id, group_metric(g, i));
+    }
+  }
+
+  for (int i = 0; i < CM_CNT; i++) {
+    metrics_family(m, &conn_metrics[i]);
+    for (conn_group_t *g = groups; g != NULL; g = g->next) {
+      for (conn_t *c = g->conns; c != NULL; c = c->next) {
+        metrics_printf(m, "%s{group=\"%llu\",addr=\"%s:%d\"} %.15g\n", conn_metrics[i].name,
+                       (unsigned long long)g->logical_group_id, print_addr(&c->addr),
+                       port_no(&c->addr), conn_metric(c, i, ts));
+      }
+    }
+  }
+
+  metric_desc_t desc = {"srtla_rec_backend_up", "gauge",
+                        "Whether the SRT server passes the health checks"};
+  metrics_family(m, &desc);
+  for (srt_backend_t *b = backends; b != NULL; b = b->next) {
+    metrics_printf(m, "%s{backend=\"%s:%s\"} %d\n", desc.name, b->host, b->port, b->healthy);
+  }
+  desc = (metric_desc_t){"srtla_rec_backend_groups", "gauge",
+                         "Groups forwarded to the SRT server"};
+  metrics_family(m, &desc);
+  for (srt_backend_t *b = backends; b != NULL; b = b->next) {
+    metrics_printf(m, "%s{backend=\"%s:%s\"} %d\n", desc.name, b->host, b->port, b->groups);
   }
+  desc = (metric_desc_t){"srtla_rec_backend_bitrate_bytes", "gauge",
+                         "Smoothed bitrate forwarded to the SRT server, in bytes per second"};
+  metrics_family(m, &desc);
+  for (srt_backend_t *b = backends; b != NULL; b = b->next) {
+    metrics_printf(m, "%s{backend=\"%s:%s\"} %lld\n", desc.name, b->host, b->port,
+                   (long long)b->bitrate);
+  }
+
+  metrics_single(m, "srtla_rec_groups", "gauge", "Connection groups", group_count);
+  desc = (metric_desc_t){"srtla_rec_io_engine_info", "gauge", "The I/O engine in use"};
+  metrics_family(m, &desc);
+  metrics_printf(m, "%s{engine=\"%s\"} 1\n", desc.name, io_engine_name());
+  metrics_single(m, "srtla_rec_loop_iterations_total", "counter",
+                 "Event loop iterations", loop_iters);
+  metrics_single(m, "srtla_rec_received_packets_total", "counter",
+                 "Packets received from the senders and the SRT servers", io_pkts);
+#ifndef _WIN32
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) == 0) {
+    metrics_single(m, "srtla_rec_cpu_seconds_total", "counter", "CPU time used",
+                   ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+                   (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6);
+  }
+#endif
+  pkt_pool_stats_t pool;
+  pkt_pool_get_stats(&pool);
+  metrics_single(m, "srtla_rec_packet_buffers", "gauge",
+                 "Buffers in the packet pool", pool.total);
+  metrics_single(m, "srtla_rec_packet_buffers_in_use", "gauge",
+                 "Packet buffers in use", pool.in_use);
+  metrics_single(m, "srtla_rec_packet_buffer_mallocs_total", "counter",
+                 "Memory allocations by the packet pool", pool.mallocs);
+}
+
+// Called at startup, and again if a hot restart handoff fails
+int metrics_open() {
+  metrics_sock = metrics_listen(flag_metrics);
+  if (metrics_sock < 0) return -1;
+
+#ifdef __linux__
+  if (flag_io_engine == IO_ENGINE_EPOLL && epoll_add(metrics_sock, EPOLLIN, &metrics_sock) != 0) {
+    close(metrics_sock);
+    metrics_sock = -1;
+    return -1;
+  }
+#endif
+  return 0;
+}
+
+void metrics_close() {
+  if (metrics_sock < 0) return;
+  close(metrics_sock); // which also removes it from the epoll
+  metrics_sock = -1;
+}
+
+/* Logs the state, groups and bitrate of a backend at the info level when
+   the state or the group count changed since the last time, or the bitrate
+   moved by more than BACKEND_LOG_RATE_CHG percent and BACKEND_LOG_RATE_MIN.
+   Otherwise only at the debug level, so that a steady load doesn't flood
+   the log */
+void backend_log_load(srt_backend_t *b) {
+  int64_t rate_chg = b->bitrate - b->logged_bitrate;
+  int changed = !b->logged || b->healthy != b->logged_healthy ||
+                b->groups != b->logged_groups ||
+                (llabs(rate_chg) > BACKEND_LOG_RATE_MIN &&
+                 llabs(rate_chg) * 100 > b->logged_bitrate * BACKEND_LOG_RATE_CHG);
+  if (!changed) {
+    debug("SRT backend %s:%d: %s, %d groups, %lld kbps\n",
+          print_addr(&b->addr), port_no(&b->addr), b->healthy ? "up" : "down",
+          b->groups, (long long)(b->bitrate * 8 / 1000));
+    return;
+  }
+
+  info("SRT backend %s:%d: %s, %d groups, %lld kbps\n",
+       print_addr(&b->addr), port_no(&b->addr), b->healthy ? "up" : "down",
+       b->groups, (long long)(b->bitrate * 8 / 1000));
+  b->logged = 1;
+  b->logged_healthy = b->healthy;
+  b->logged_groups = b->groups;
+  b->logged_bitrate = b->bitrate;
 }
 
 /*
@@ -660,6 +1906,15 @@ void connection_cleanup(time_t ts) {
       prev_c = &c->next;
     }
 
+    debug("Group #%llu: %d packets arrived out of order, reorder distance avg %d max %d\n",
+          (unsigned long long)g->logical_group_id, g->reordered_pkts,
+          g->reordered_pkts ? (int)(g->reorder_dist_sum / g->reordered_pkts) : 0,
+          g->reorder_dist_max);
+    if (g->caps & SRTLA_CAP_FEC) {
+      debug("Group #%llu: FEC recovered %d packets, %d losses unrecoverable\n",
+            (unsigned long long)g->logical_group_id, g->fec_recovered, g->fec_unrecoverable);
+    }
+
     if (g->conns == NULL && (g->created_at + GROUP_TIMEOUT) < ts) {
       removed_groups++;
       info("Group %p: removed (no connections)\n", g);
@@ -676,13 +1931,13 @@ void connection_cleanup(time_t ts) {
       uint64_t tmp = 0;
       if (get_ms(&tmp) == 0) now_ms = tmp;
       if (now_ms >= (uint64_t)g->next_srt_retry_ms) {
-        // Try to handshake with the existing srt_addr
+        // Fail over to another backend if ours is down
+        if (g->backend == NULL || !g->backend->healthy) {
+          group_place(g);
+        }
+
         info("Group #%llu: retrying SRT handshake attempt %d\n", (unsigned long long)g->logical_group_id, g->srt_retry_attempts);
-        srt_handshake_t hs_packet = {0};
-        hs_packet.header.type = htobe16(SRT_TYPE_HANDSHAKE);
-        hs_packet.version = htobe32(4);
-        hs_packet.ext_field = htobe16(2);
-        hs_packet.handshake_type = htobe32(1);
+        srt_handshake_t hs_packet = srt_induction_pkt();
 
         int sock = create_udp_socket();
         if (sock >= 0) {
@@ -692,14 +1947,22 @@ void connection_cleanup(time_t ts) {
 #else
           setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &to, sizeof(to));
 #endif
-          if (connect(sock, &srt_addr, addr_len) == 0) {
+          if (connect(sock, &g->backend->addr, addr_len) == 0) {
             int sent = send(sock, (const char*)&hs_packet, sizeof(hs_packet), 0);
             if (sent == sizeof(hs_packet)) {
               char buf[MTU];
               int r = recv(sock, buf, MTU, 0);
               if (r == sizeof(hs_packet)) {
-                // success
                 g->srt_sock = sock;
+#ifdef __linux__
+                if (srt_sock_watch(g) != 0) {
+                  g->srt_sock = -1;
+                  r = -1;
+                }
+#endif
+              }
+              if (r == sizeof(hs_packet)) {
+                // success
                 g->state = G_ACTIVE;
                 g->srt_retry_attempts = 0;
                 info("Group #%llu: SRT handshake succeeded, group ACTIVE\n", (unsigned long long)g->logical_group_id);
@@ -724,6 +1987,18 @@ void connection_cleanup(time_t ts) {
     }
   }
 
+  for (srt_backend_t *b = backends; b != NULL; b = b->next) {
+    backend_log_load(b);
+  }
+
+  io_stats_report();
+
+  pkt_pool_stats_t pool;
+  pkt_pool_get_stats(&pool);
+  debug("Packet buffers: %d in use of %d, %llu allocations, %llu mallocs\n",
+        pool.in_use, pool.total, (unsigned long long)pool.allocs,
+        (unsigned long long)pool.mallocs);
+
   debug("Clean up run ended. Counted %d groups and %d connections. "
         "Removed %d groups and %d connections\n",
         total_groups, total_conns, removed_groups, removed_conns);
@@ -731,19 +2006,21 @@ void connection_cleanup(time_t ts) {
 
 /*
 SRT is connection-oriented and it won't reply to our packets at this point
-unless we start a handshake, so we do that for each resolved address
+unless we start a handshake, so we send one to each resolved address. This
+doesn't wait for the replies: the probes of all the backends run
+concurrently while srtla_sock is already being served, and
+backend_probe_poll() picks the first address that answers. If none does
+within SRT_PROBE_TIMEOUT, the first resolved address is used
 
 Returns: -1 when an error has been encountered
-          0 when the address was resolved but SRT appears unreachable
-          1 when the address was resolved and SRT appears reachable
+          0 when the probes have been sent
 */
-int resolve_srt_addr(char *host, char *port) {
+int resolve_srt_addr(srt_backend_t *b, uint64_t deadline) {
+  char *host = b->host;
+  char *port = b->port;
+
   // Let's set up an SRT handshake induction packet
-  srt_handshake_t hs_packet = {0};
-  hs_packet.header.type = htobe16(SRT_TYPE_HANDSHAKE);
-  hs_packet.version = htobe32(4);
-  hs_packet.ext_field = htobe16(2);
-  hs_packet.handshake_type = htobe32(1);
+  srt_handshake_t hs_packet = srt_induction_pkt();
 
   struct addrinfo hints;
   memset(&hints, 0, sizeof(hints));
@@ -756,62 +2033,563 @@ int resolve_srt_addr(char *host, char *port) {
     return -1;
   }
 
-  int tmp_sock = socket(AF_INET, SOCK_DGRAM, 0);
-  if (tmp_sock < 0) {
-    perror("failed to create a UDP socket");
-    return -1;
+  // Until a probe succeeds
+  b->addr = *srt_addrs->ai_addr;
+  b->healthy = 0;
+  b->probe_cnt = 0;
+  b->probe_deadline = deadline;
+
+  for (struct addrinfo *addr = srt_addrs;
+       addr != NULL && b->probe_cnt < SRT_PROBE_MAX_ADDRS; addr = addr->ai_next) {
+    info("Trying to connect to SRT at %s:%s...\n", print_addr(addr->ai_addr), port);
+
+    int sock = create_udp_socket();
+    if (sock < 0) {
+      perror("failed to create a UDP socket");
+      freeaddrinfo(srt_addrs);
+      return -1;
+    }
+
+    ret = connect(sock, addr->ai_addr, addr->ai_addrlen);
+    if (ret == 0) {
+      ret = send(sock, (const char*)&hs_packet, sizeof(hs_packet), 0);
+    }
+    if (ret != sizeof(hs_packet)) {
+      info("%s:%s: error\n", print_addr(addr->ai_addr), port);
+      close(sock);
+      continue;
+    }
+
+    b->probe_socks[b->probe_cnt] = sock;
+    b->probe_addrs[b->probe_cnt] = *addr->ai_addr;
+    b->probe_cnt++;
   }
-  struct timeval to = { .tv_sec = 1, .tv_usec = 0};
-#ifdef _WIN32
-  ret = setsockopt(tmp_sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&to, sizeof(to));
-#else
-  ret = setsockopt(tmp_sock, SOL_SOCKET, SO_RCVTIMEO, &to, sizeof(to));
+
+  freeaddrinfo(srt_addrs);
+
+  if (b->probe_cnt) {
+    backends_probing++;
+  } else {
+    fprintf(stderr, "WARNING: Failed to confirm that a SRT server is reachable at any address\n"
+                    "Proceeding with the first address %s\n", print_addr(&b->addr));
+  }
+
+  return 0;
+}
+
+srt_backend_t *backend_add(char *host, char *port) {
+  srt_backend_t *b = calloc(1, sizeof(srt_backend_t));
+  if (b == NULL) {
+    err("malloc() failed\n");
+    exit(EXIT_FAILURE);
+  }
+  b->host = host;
+  b->port = port;
+  b->check_sock = -1;
+
+  // Keep them in the order they were given
+  srt_backend_t **next = &backends;
+  while (*next) next = &(*next)->next;
+  *next = b;
+  backend_count++;
+
+  return b;
+}
+
+/*
+
+Hot restart
+
+A new srtla_rec started with the same --hot-restart-sock takes over from the
+running one without dropping any group: the old process sends it srtla_sock,
+the SRT sockets of the groups and a snapshot of the groups and their
+connections, then exits. The packets arriving in the meantime wait in the
+shared sockets' buffers
+
+Exactly one of the processes must go on serving the sockets. Once the new
+process has read the state it sends 'K' and waits; the old one answers
+with 'C' and exits right away, and the new one only starts serving once it
+has read it. If the old process gives up waiting for 'K', it closes the
+connection and resumes, and the new process exits when it reads EOF
+instead of 'C'. If the new process is gone by then, sending 'C' fails and
+the old one resumes too
+
+*/
+#ifndef _WIN32
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t group_cnt;
+  uint32_t fd_cnt; // srtla_sock followed by the SRT sockets, in group order
+  uint64_t group_seq;
+} hot_restart_hdr_t;
+
+typedef struct {
+  char id[SRTLA_ID_LEN];
+  struct sockaddr last_addr;
+  int64_t created_at;
+  uint64_t logical_group_id;
+  int32_t state;
+  int32_t has_srt_sock;
+  uint64_t next_srt_retry_ms;
+  int32_t srt_retry_attempts;
+  int32_t max_sn;
+  uint32_t caps;
+  uint32_t conn_cnt;
+  char backend[128]; // HOST:PORT
+} hot_restart_group_t;
+
+typedef struct {
+  struct sockaddr addr;
+  int64_t last_rcvd;
+  int32_t recv_idx;
+  uint32_t recv_log[RECV_ACK_INT];
+} hot_restart_conn_t;
+
+#define HOT_RESTART_MAX_FDS (MAX_GROUPS + 1)
+
+void backend_name(srt_backend_t *b, char *buf, int len) {
+  snprintf(buf, len, "%s:%s", b->host, b->port);
+}
+
+srt_backend_t *backend_find(char *name) {
+  char buf[128];
+  for (srt_backend_t *b = backends; b != NULL; b = b->next) {
+    backend_name(b, buf, sizeof(buf));
+    if (strcmp(buf, name) == 0) return b;
+  }
+  return NULL;
+}
+
+int write_all(int fd, const void *buf, size_t len) {
+  const char *p = buf;
+  while (len) {
+    ssize_t ret = write(fd, p, len);
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret <= 0) return -1;
+    p += ret;
+    len -= ret;
+  }
+  return 0;
+}
+
+int read_all(int fd, void *buf, size_t len) {
+  char *p = buf;
+  while (len) {
+    ssize_t ret = read(fd, p, len);
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret <= 0) return -1;
+    p += ret;
+    len -= ret;
+  }
+  return 0;
+}
+
+/* Called in the old process when the new one connects. Only returns if the
+   new process didn't confirm the takeover, in which case we keep going */
+void hot_restart_handoff() {
+  int fd = accept(hot_restart_sock, NULL, NULL);
+  if (fd < 0) return;
+
+  uint64_t start_ms;
+  get_ms(&start_ms);
+
+  // Closed before the new process gets the state, so that it can open its own
+  metrics_close();
+
+  hot_restart_hdr_t hdr = {HOT_RESTART_MAGIC, HOT_RESTART_VERSION, 0, 1, global_group_seq};
+  int fds[HOT_RESTART_MAX_FDS];
+  fds[0] = srtla_sock;
+  for (conn_group_t *g = groups; g != NULL; g = g->next) {
+    hdr.group_cnt++;
+    if (g->srt_sock >= 0) fds[hdr.fd_cnt++] = g->srt_sock;
+  }
+
+  // The header carries all the file descriptors
+  char cmsg_buf[CMSG_SPACE(sizeof(fds))];
+  memset(cmsg_buf, 0, sizeof(cmsg_buf));
+  struct iovec iov = {&hdr, sizeof(hdr)};
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cmsg_buf;
+  msg.msg_controllen = CMSG_SPACE(sizeof(int) * hdr.fd_cnt);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * hdr.fd_cnt);
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * hdr.fd_cnt);
+  if (sendmsg(fd, &msg, 0) != sizeof(hdr)) goto err;
+
+  for (conn_group_t *g = groups; g != NULL; g = g->next) {
+    hot_restart_group_t hg = {0};
+    memcpy(hg.id, g->id, SRTLA_ID_LEN);
+    hg.last_addr = g->last_addr;
+    hg.created_at = g->created_at;
+    hg.logical_group_id = g->logical_group_id;
+    hg.state = g->state;
+    hg.has_srt_sock = g->srt_sock >= 0;
+    hg.next_srt_retry_ms = g->next_srt_retry_ms;
+    hg.srt_retry_attempts = g->srt_retry_attempts;
+    hg.max_sn = g->max_sn;
+    hg.caps = g->caps;
+    hg.conn_cnt = group_count_conns(g);
+    if (g->backend) backend_name(g->backend, hg.backend, sizeof(hg.backend));
+    if (write_all(fd, &hg, sizeof(hg)) != 0) goto err;
+
+    for (conn_t *c = g->conns; c != NULL; c = c->next) {
+      hot_restart_conn_t hc = {0};
+      hc.addr = c->addr;
+      hc.last_rcvd = c->last_rcvd;
+      hc.recv_idx = c->recv_idx;
+      memcpy(hc.recv_log, c->recv_log, sizeof(hc.recv_log));
+      if (write_all(fd, &hc, sizeof(hc)) != 0) goto err;
+    }
+  }
+
+  struct timeval tv = {HOT_RESTART_ACK_TIMEOUT, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  char ack;
+  if (read(fd, &ack, 1) != 1 || ack != 'K') goto err;
+  char commit = 'C';
+  if (write(fd, &commit, 1) != 1) goto err;
+
+  // From here on the new process is serving the sockets, never resume
+  uint64_t ms;
+  get_ms(&ms);
+  info("Handed over %u groups to the new srtla_rec in %d ms, exiting\n",
+       hdr.group_cnt, (int)(ms - start_ms));
+  exit(EXIT_SUCCESS);
+
+err:
+  err("Hot restart handoff failed, resuming\n");
+  close(fd);
+  if (flag_metrics && metrics_open() != 0) {
+    err("Failed to listen for metrics scrapes at %s\n", flag_metrics);
+  }
+}
+
+/* Returns 1 if we've taken over from a running srtla_rec, 0 if there was
+   none. Exits if there was one but the takeover failed, as it keeps the
+   listening port */
+int hot_restart_takeover(char *path) {
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return 0;
+
+  struct sockaddr_un addr = {0};
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return 0;
+  }
+
+  uint64_t start_ms;
+  get_ms(&start_ms);
+  info("Taking over from the srtla_rec at %s...\n", path);
+
+  hot_restart_hdr_t hdr;
+  int fds[HOT_RESTART_MAX_FDS];
+  int fd_cnt = 0;
+  char cmsg_buf[CMSG_SPACE(sizeof(fds))];
+  struct iovec iov = {&hdr, sizeof(hdr)};
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cmsg_buf;
+  msg.msg_controllen = sizeof(cmsg_buf);
+  int ret = recvmsg(fd, &msg, 0);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+    fd_cnt = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * fd_cnt);
+  }
+  if (ret != sizeof(hdr) || hdr.magic != HOT_RESTART_MAGIC) {
+    err("Invalid hot restart state\n");
+    goto err;
+  }
+  if (hdr.version != HOT_RESTART_VERSION) {
+    err("Incompatible hot restart state version %u\n", hdr.version);
+    goto err;
+  }
+  if (fd_cnt != (int)hdr.fd_cnt || fd_cnt < 1 || hdr.group_cnt > MAX_GROUPS) {
+    err("Invalid hot restart state\n");
+    goto err;
+  }
+
+  srtla_sock = fds[0];
+  global_group_seq = hdr.group_seq;
+
+  int next_fd = 1;
+  for (uint32_t i = 0; i < hdr.group_cnt; i++) {
+    hot_restart_group_t hg;
+    if (read_all(fd, &hg, sizeof(hg)) != 0) goto err_read;
+    hg.backend[sizeof(hg.backend) - 1] = '\0';
+
+    conn_group_t *g = group_create(hg.id, hg.created_at);
+    if (g == NULL) goto err_read;
+    group_count++;
+    memcpy(g->id, hg.id, SRTLA_ID_LEN);
+    g->last_addr = hg.last_addr;
+    g->logical_group_id = hg.logical_group_id;
+    g->state = hg.state;
+    g->next_srt_retry_ms = hg.next_srt_retry_ms;
+    g->srt_retry_attempts = hg.srt_retry_attempts;
+    g->max_sn = hg.max_sn;
+    g->caps = hg.caps;
+    if (g->caps & SRTLA_CAP_FEC) {
+      g->fec_rx = malloc(sizeof(fec_rx_pkt_t) * FEC_RX_WINDOW);
+      if (g->fec_rx == NULL) goto err_read;
+      for (int i = 0; i < FEC_RX_WINDOW; i++) {
+        g->fec_rx[i].sn = -1;
+      }
+    }
+
+    g->backend = backend_find(hg.backend);
+    if (g->backend) g->backend->groups++;
+    if (hg.has_srt_sock) {
+      if (next_fd >= fd_cnt) goto err_read;
+      int sock = fds[next_fd++];
+      if (g->backend == NULL) {
+        // The SRT server was removed, the group will be placed on another one
+        info("Group #%llu: SRT server %s is gone, reconnecting\n",
+             (unsigned long long)g->logical_group_id, hg.backend);
+        close(sock);
+      } else {
+        g->srt_sock = sock;
+#ifdef __linux__
+        if (srt_sock_watch(g) != 0) goto err_read;
 #endif
-  if (ret != 0) {
-    perror("failed to set a socket timeout");
+      }
+    }
+
+    for (uint32_t j = 0; j < hg.conn_cnt; j++) {
+      hot_restart_conn_t hc;
+      if (read_all(fd, &hc, sizeof(hc)) != 0) goto err_read;
+      if (j >= MAX_CONNS_PER_GROUP) continue;
+
+      conn_t *c = calloc(1, sizeof(conn_t));
+      if (c == NULL) goto err_read;
+      c->addr = hc.addr;
+      c->last_rcvd = hc.last_rcvd;
+      c->recv_idx = hc.recv_idx % RECV_ACK_INT;
+      memcpy(c->recv_log, hc.recv_log, sizeof(c->recv_log));
+      c->next = g->conns;
+      g->conns = c;
+    }
+  }
+
+  char ack = 'K';
+  if (write(fd, &ack, 1) != 1) goto err_read;
+  // Until the old process confirms that it has stopped, it may still resume
+  if (read(fd, &ack, 1) != 1 || ack != 'C') {
+    err("The srtla_rec at %s didn't hand over, exiting\n", path);
+    goto err;
+  }
+  close(fd);
+
+  uint64_t ms;
+  get_ms(&ms);
+  info("Took over %u groups in %d ms\n", hdr.group_cnt, (int)(ms - start_ms));
+  return 1;
+
+err_read:
+  err("Failed to read the hot restart state\n");
+err:
+  for (int i = 0; i < fd_cnt; i++) close(fds[i]);
+  close(fd);
+  exit(EXIT_FAILURE);
+}
+
+int hot_restart_listen(char *path) {
+  struct sockaddr_un addr = {0};
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  // Either stale, or left behind by the process we've taken over from
+  unlink(path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 1) != 0) {
+    close(fd);
     return -1;
   }
 
-  int found = -1;
-  for (struct addrinfo *addr = srt_addrs; addr != NULL && found == -1; addr = addr->ai_next) {
-    info("Trying to connect to SRT at %s:%s... ", print_addr(addr->ai_addr), port);
-    /* We're not printing this at all log levels, but a
-       flush won't hurt if we didn't print anything */
-    fflush(stderr);    ret = connect(tmp_sock, addr->ai_addr, addr->ai_addrlen);
-    if (ret == 0) {
-#ifdef _WIN32
-      ret = send(tmp_sock, (const char*)&hs_packet, sizeof(hs_packet), 0);
-#else
-      ret = send(tmp_sock, &hs_packet, sizeof(hs_packet), 0);
-#endif
-      if (ret == sizeof(hs_packet)) {        char buf[MTU];
-        ret = recv(tmp_sock, buf, MTU, 0);
-        if (ret == sizeof(hs_packet)) {
-          info("success\n");
-          srt_addr = *addr->ai_addr;
-          found = 1;
-        }
-      } // ret == sizeof(buf)
-    } // ret == 0
+#ifdef __linux__
+  if (flag_io_engine == IO_ENGINE_EPOLL && epoll_add(fd, EPOLLIN, &hot_restart_sock) != 0) {
+    close(fd);
+    return -1;
+  }
+#endif
+  hot_restart_sock = fd;
+
+  /* Don't get killed by sending the commit to a new process that already
+     gave up, the failed write() makes us resume instead */
+  signal(SIGPIPE, SIG_IGN);
+
+  return 0;
+}
+#endif
+
+#ifdef HAVE_IO_URING
+/*
+  io_uring event loop
+*/
+int uring_hot_restart_pending = 0;
+int uring_metrics_pending = 0;
+
+conn_group_t *group_find_by_uring_ud(uint64_t ud) {
+  conn_group_t *g = uring_srt_groups[(ud >> 2) & (URING_SLOTS - 1)];
+  return (g != NULL && g->uring_ud == ud) ? g : NULL;
+}
+
+void uring_handle_srtla(struct io_uring_cqe *cqe, char *buf, time_t ts) {
+  if (buf != NULL && cqe->res > 0) {
+    // The buffer holds the header, the source address and then the payload
+    struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buf;
+    char *name = buf + sizeof(*out);
+    char *payload = name + uring.srtla_msg.msg_namelen + uring.srtla_msg.msg_controllen;
+    int n = cqe->res - (payload - buf);
+
+    struct sockaddr srtla_addr;
+    memset(&srtla_addr, 0, sizeof(srtla_addr));
+    memcpy(&srtla_addr, name, min(out->namelen, sizeof(srtla_addr)));
+    if (n >= 0) handle_srtla_pkt(payload, n, srtla_addr, ts);
+  }
+
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    uring.armed--;
+    if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+      err("Failed to read a srtla packet (%s)\n", strerror(-cqe->res));
+    }
+    if (!uring.quiescing) uring_arm_srtla();
+  }
+}
+
+void uring_handle_srt(struct io_uring_cqe *cqe, char *buf) {
+  conn_group_t *g = group_find_by_uring_ud(cqe->user_data);
 
-    if (found == -1) {
-      info("error\n");
+  if (g != NULL) {
+    if (buf != NULL && cqe->res >= SRT_MIN_LEN) {
+      handle_srt_pkt(g, buf, cqe->res);
+    } else if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+      if (cqe->res < 0) errno = -cqe->res;
+      handle_srt_read_failure(g);
+      g = NULL; // the receive was cancelled, if the group still exists
     }
   }
-  close(tmp_sock);
 
-  if (found == -1) {
-    srt_addr = *srt_addrs->ai_addr;
-    fprintf(stderr, "WARNING: Failed to confirm that a SRT server is reachable at any address\n"
-                    "Proceeding with the first address %s\n", print_addr(&srt_addr));
-    found = 0;
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    uring.armed--;
+    if (g != NULL && g->uring_ud == cqe->user_data) {
+      uring_srt_release(g);
+      if (!uring.quiescing) uring_arm_srt(g);
+    }
   }
+}
 
-  freeaddrinfo(srt_addrs);
+void uring_reap(time_t ts) {
+  unsigned head = *uring.cq_head;
+  while (head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe cqe = uring.cqes[head & *uring.cq_mask];
+    head++;
+    __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+
+    char *buf = NULL;
+    int bid = -1;
+    if (cqe.flags & IORING_CQE_F_BUFFER) {
+      bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+      buf = uring.bufs + bid * URING_BUF_SZ;
+    }
+
+    switch (cqe.user_data & 3) {
+      case UD_SRTLA:
+        uring_handle_srtla(&cqe, buf, ts);
+        break;
+      case UD_SRT:
+        uring_handle_srt(&cqe, buf);
+        break;
+      case UD_HOT_RESTART:
+        if (cqe.user_data == UD_METRICS) {
+          // Cancelled by uring_quiesce(), re-armed if the handoff fails
+          if (cqe.res != -ECANCELED) uring_metrics_pending = 1;
+        } else {
+          uring_hot_restart_pending = 1;
+        }
+        break;
+    }
+
+    if (bid >= 0) uring_buf_recycle(bid);
+  }
 
-  return found;
+  // Only give the buffers back to the kernel once per batch
+  uring_buf_publish();
+}
+
+/* Cancels all the receives and handles the packets they already got, so
+   that none are left behind in our ring during a hot restart */
+void uring_quiesce(time_t ts) {
+  uring.quiescing = 1;
+  uring_cancel(0, IORING_ASYNC_CANCEL_ANY);
+  for (int i = 0; i < 100 && uring.armed > 0; i++) {
+    uring_enter(10);
+    uring_reap(ts);
+  }
+  uring.quiescing = 0;
 }
 
+void uring_run() {
+  uring_arm_srtla();
+  uring_arm_hot_restart();
+  uring_arm_metrics();
+
+  while(1) {
+    // Poll more often while the SRT addresses are being probed
+    int ret = uring_enter(metrics_busy() ? METRICS_POLL_INT : (backends_probing ? 10 : 1000));
+    if (ret < 0 && errno != ETIME && errno != EINTR && errno != EBUSY) {
+      err("io_uring_enter() failed (%s)\n", strerror(errno));
+    }
+
+    time_t ts = 0;
+    ret = get_seconds(&ts);
+    if (ret != 0) {
+      err("Failed to get the timestamp\n");
+    }
+    uring_reap(ts);
+    loop_iters++;
+
+    if (uring_metrics_pending) {
+      uring_metrics_pending = 0;
+      metrics_serve(metrics_sock, metrics_fill);
+      uring_arm_metrics();
+    }
+
+    if (uring_hot_restart_pending) {
+      uring_hot_restart_pending = 0;
+      uring_quiesce(ts);
+      hot_restart_handoff();
+
+      // Still here, the new process didn't take over
+      uring_arm_srtla();
+      for (conn_group_t *g = groups; g != NULL; g = g->next) {
+        if (g->srt_sock >= 0) uring_arm_srt(g);
+      }
+      uring_arm_hot_restart();
+      uring_arm_metrics();
+    }
+
+    connection_cleanup(ts);
+    metrics_poll();
+    uint64_t ms;
+    if (get_ms(&ms) == 0) {
+      backends_tick(ms);
+      fec_tick(ms);
+    }
+  }
+}
+#endif
+
 #define ARG_LISTEN_PORT (argv[1])
 #define ARG_SRT_HOST    (argv[2])
 #define ARG_SRT_PORT    (argv[3])
@@ -832,9 +2610,29 @@ int main(int argc, char **argv) {
   }
   if (argc < 4) exit_help();
 
+  backend_add(ARG_SRT_HOST, ARG_SRT_PORT);
+
   // parse optional flags after positional args
   for (int i = 4; i < argc; i++) {
-    if (strcmp(argv[i], "--no-auto-reconnect") == 0) {
+    if (strcmp(argv[i], "--backend") == 0 && i + 1 < argc) {
+      char *sep = strrchr(argv[i+1], ':');
+      if (sep == NULL || parse_port(sep + 1) < 0) {
+        err("Warning: invalid SRT backend %s\n", argv[i+1]);
+      } else {
+        *sep = '\0';
+        backend_add(argv[i+1], sep + 1);
+      }
+      i++;
+    } else if (strcmp(argv[i], "--placement") == 0 && i + 1 < argc) {
+      if (strcmp(argv[i+1], "least-groups") == 0) {
+        flag_placement = PLACE_LEAST_GROUPS;
+      } else if (strcmp(argv[i+1], "least-bitrate") == 0) {
+        flag_placement = PLACE_LEAST_BITRATE;
+      } else {
+        err("Warning: unknown placement %s\n", argv[i+1]);
+      }
+      i++;
+    } else if (strcmp(argv[i], "--no-auto-reconnect") == 0) {
       flag_auto_reconnect = 0;
     } else if (strcmp(argv[i], "--auto-reconnect") == 0) {
       flag_auto_reconnect = 1;
@@ -843,6 +2641,25 @@ int main(int argc, char **argv) {
     } else if (strcmp(argv[i], "--reconnect-interval-ms") == 0 && i + 1 < argc) {
       flag_reconnect_interval_ms = atoi(argv[i+1]);
       i++;
+#ifdef __linux__
+    } else if (strcmp(argv[i], "--io-engine") == 0 && i + 1 < argc) {
+      if (strcmp(argv[i+1], "epoll") == 0) {
+        flag_io_engine = IO_ENGINE_EPOLL;
+      } else if (strcmp(argv[i+1], "io_uring") == 0) {
+        flag_io_engine = IO_ENGINE_IO_URING;
+      } else {
+        err("Warning: unknown I/O engine %s\n", argv[i+1]);
+      }
+      i++;
+#endif
+#ifndef _WIN32
+    } else if (strcmp(argv[i], "--hot-restart-sock") == 0 && i + 1 < argc) {
+      flag_hot_restart_sock = argv[i+1];
+      i++;
+#endif
+    } else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+      flag_metrics = argv[i+1];
+      i++;
     } else {
       err("Warning: unknown option %s\n", argv[i]);
     }
@@ -852,11 +2669,7 @@ int main(int argc, char **argv) {
 
   int srtla_port = parse_port(ARG_LISTEN_PORT);
   if (srtla_port < 0) exit_help();
-  // Try to detect if the SRT server is reachable.
-  int ret = resolve_srt_addr(ARG_SRT_HOST, ARG_SRT_PORT);
-  if (ret < 0) {
-    exit(EXIT_FAILURE);
-  }
+  int ret;
 
 #ifdef _WIN32
   // Windows'ta urandom yerine CryptGenRandom kullanacağız, bu değişkene ihtiyaç yok
@@ -876,39 +2689,90 @@ int main(int argc, char **argv) {
     perror("epoll_create");
     exit(1);
   }
+
+#ifdef HAVE_IO_URING
+  if (flag_io_engine == IO_ENGINE_IO_URING && uring_init() != 0) {
+    err("io_uring is not available, falling back to epoll\n");
+    flag_io_engine = IO_ENGINE_EPOLL;
+  }
+#else
+  if (flag_io_engine == IO_ENGINE_IO_URING) {
+    err("This build doesn't support io_uring, falling back to epoll\n");
+    flag_io_engine = IO_ENGINE_EPOLL;
+  }
+#endif
 #endif
 
-  // Set up the listener socket for incoming SRT connections
-  listen_addr.sin_family = AF_INET;
-  listen_addr.sin_addr.s_addr = INADDR_ANY;
-  listen_addr.sin_port = htons(srtla_port);
-  srtla_sock = socket(AF_INET, SOCK_DGRAM, 0);
-  if (srtla_sock < 0) {
-    perror("socket creation failed");
-    exit(EXIT_FAILURE);
+  int taken_over = 0;
+#ifndef _WIN32
+  if (flag_hot_restart_sock) {
+    taken_over = hot_restart_takeover(flag_hot_restart_sock);
   }
+#endif
 
-  ret = bind(srtla_sock, (const struct sockaddr *)&listen_addr, addr_len);
-  if (ret < 0) {
-    perror("bind failed");
-    exit(EXIT_FAILURE);
+  // Set up the listener socket for incoming SRT connections
+  if (!taken_over) {
+    listen_addr.sin_family = AF_INET;
+    listen_addr.sin_addr.s_addr = INADDR_ANY;
+    listen_addr.sin_port = htons(srtla_port);
+    srtla_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (srtla_sock < 0) {
+      perror("socket creation failed");
+      exit(EXIT_FAILURE);
+    }
+
+    ret = bind(srtla_sock, (const struct sockaddr *)&listen_addr, addr_len);
+    if (ret < 0) {
+      perror("bind failed");
+      exit(EXIT_FAILURE);
+    }
   }
 
 #ifdef __linux__
-  ret = epoll_add(srtla_sock, EPOLLIN, NULL);
+  ret = (flag_io_engine == IO_ENGINE_EPOLL) ? epoll_add(srtla_sock, EPOLLIN, NULL) : 0;
   if (ret != 0) {
     perror("failed to add the srtla sock to the epoll\n");
     exit(EXIT_FAILURE);
   }
 #endif
 
-  info("srtla_rec is now running\n");
+  /* Try to detect if the SRT servers are reachable. The senders can already
+     register while the probes are in flight */
+  uint64_t probe_deadline;
+  get_ms(&probe_deadline);
+  probe_deadline += SRT_PROBE_TIMEOUT;
+  for (srt_backend_t *b = backends; b != NULL; b = b->next) {
+    ret = resolve_srt_addr(b, probe_deadline);
+    if (ret < 0) {
+      exit(EXIT_FAILURE);
+    }
+  }
+
+#ifndef _WIN32
+  if (flag_hot_restart_sock && hot_restart_listen(flag_hot_restart_sock) != 0) {
+    err("Failed to listen for hot restarts at %s\n", flag_hot_restart_sock);
+  }
+#endif
+
+  if (flag_metrics && metrics_open() != 0) {
+    err("Failed to listen for metrics scrapes at %s\n", flag_metrics);
+    exit(EXIT_FAILURE);
+  }
+
+  info("srtla_rec is now running with %s\n", io_engine_name());
+
+#ifdef HAVE_IO_URING
+  if (flag_io_engine == IO_ENGINE_IO_URING) uring_run();
+#endif
 
   while(1) {
 #ifdef __linux__
     #define MAX_EPOLL_EVENTS 10
     struct epoll_event events[MAX_EPOLL_EVENTS];
-    int eventcnt = epoll_wait(socket_epoll, events, MAX_EPOLL_EVENTS, 1000);
+    // Poll more often while the SRT addresses are being probed
+    int timeout = metrics_busy() ? METRICS_POLL_INT : (backends_probing ? 10 : 1000);
+    int eventcnt = epoll_wait(socket_epoll, events, MAX_EPOLL_EVENTS, timeout);
+    loop_iters++;
 
     time_t ts = 0;
     int ret = get_seconds(&ts);
@@ -920,12 +2784,23 @@ int main(int argc, char **argv) {
       group_cnt = group_count;
       if (events[i].data.ptr == NULL) {
         handle_srtla_data(ts);
+      } else if (events[i].data.ptr == &hot_restart_sock) {
+        hot_restart_handoff();
+        break;
+      } else if (events[i].data.ptr == &metrics_sock) {
+        metrics_serve(metrics_sock, metrics_fill);
       } else {
         handle_srt_data((conn_group_t*)events[i].data.ptr);
       }
       if (group_count < group_cnt) break;
     }
     connection_cleanup(ts);
+    metrics_poll();
+    uint64_t ms;
+    if (get_ms(&ms) == 0) {
+      backends_tick(ms);
+      fec_tick(ms);
+    }
 #else
     time_t ts = 0;
     int ret = get_seconds(&ts);
@@ -937,24 +2812,51 @@ int main(int argc, char **argv) {
     FD_ZERO(&readfds);
     int maxfd = srtla_sock;
     FD_SET(srtla_sock, &readfds);
+#ifndef _WIN32
+    if (hot_restart_sock >= 0) {
+      FD_SET(hot_restart_sock, &readfds);
+      if (hot_restart_sock > maxfd) maxfd = hot_restart_sock;
+    }
+#endif
+    if (metrics_sock >= 0) {
+      FD_SET(metrics_sock, &readfds);
+      if (metrics_sock > maxfd) maxfd = metrics_sock;
+    }
     for (conn_group_t *g = groups; g != NULL; g = g->next) {
       if (g->srt_sock > 0) {
         FD_SET(g->srt_sock, &readfds);
         if (g->srt_sock > maxfd) maxfd = g->srt_sock;
       }
     }
-    struct timeval tv = {0, 100000}; // 100ms
+    struct timeval tv = {0, backends_probing ? 10000 : 100000}; // 10 or 100ms
+    if (metrics_busy()) tv.tv_usec = METRICS_POLL_INT * 1000;
     int ready = select(maxfd + 1, &readfds, NULL, NULL, &tv);
+    loop_iters++;
     if (ready > 0) {
+#ifndef _WIN32
+      if (hot_restart_sock >= 0 && FD_ISSET(hot_restart_sock, &readfds)) {
+        hot_restart_handoff();
+        continue;
+      }
+#endif
       if (FD_ISSET(srtla_sock, &readfds)) {
         handle_srtla_data(ts);
       }
+      if (metrics_sock >= 0 && FD_ISSET(metrics_sock, &readfds)) {
+        metrics_serve(metrics_sock, metrics_fill);
+      }
       for (conn_group_t *g = groups; g != NULL; g = g->next) {
         if (g->srt_sock > 0 && FD_ISSET(g->srt_sock, &readfds)) {
           handle_srt_data(g);
         }
       }    }
     connection_cleanup(ts);
+    metrics_poll();
+    uint64_t ms;
+    if (get_ms(&ms) == 0) {
+      backends_tick(ms);
+      fec_tick(ms);
+    }
 #endif
   } // while(1);
 
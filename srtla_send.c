@@ -16,6 +16,10 @@
     along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
+#ifdef __linux__
+#define _GNU_SOURCE // recvmmsg() and sendmmsg()
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -37,6 +41,22 @@ typedef int socklen_t;
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #endif
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#endif
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#define HAVE_THREADS
+#endif
 
 #include "common.h"
 
@@ -45,9 +65,23 @@ typedef int socklen_t;
 #define REG2_TIMEOUT 4
 #define REG3_TIMEOUT 4
 #define GLOBAL_TIMEOUT 10
+#define JOIN_MAX_ADDRS 8 // resolved receiver addresses probed when joining
 #define IDLE_TIME 1
 
 #define SEND_BUF_SIZE (8 * 1024 * 1024)
+#define SEND_BUF_MIN  (64 * 1024)
+#define SEND_BUF_BDP_MULT 4     // adaptive SO_SNDBUF size, in BDPs
+#define OUTQ_SAMPLE_INT (2 * 1000) // us, minimum interval between SIOCOUTQ calls
+
+/* Batched I/O: packets drained from the SRT caller per recvmmsg() call, and
+   per link per sendmmsg() call. BATCH_HIST_SZ power of two histogram buckets */
+#define IO_BATCH      32
+#define BATCH_HIST_SZ 6
+
+/* Threaded mode ring sizes, must be powers of two */
+#define TX_RING_SZ 256
+#define FB_RING_SZ 1024
+#define WORKER_POLL_MS 100
 
 #ifdef _WIN32
 #undef min
@@ -72,46 +106,295 @@ typedef int socklen_t;
 
 #define LOG_PKT_INT 20
 
+/* RTT estimation, see conn_update_rtt(). The min-RTT sample expires after
+   MIN_RTT_WIN so that a link whose path got longer is eventually re-measured */
+#define MIN_RTT_WIN   (10 * 1000 * 1000) // us
+#define RTT_MAX       (60 * 1000 * 1000) // us, larger samples are discarded
+#define KEEPALIVE_TS_LEN (2 + sizeof(uint64_t))
+
+/* Failure detection, see conn_liveness_tick(). Each link's retransmission
+   timeout is derived from its RTT like TCP's RTO */
+#define RTO_MIN        (100 * 1000)      // us
+#define RTO_MAX        (1000 * 1000)     // us, also used before the first RTT sample
+#define KA_INT_MIN     (25 * 1000)       // us, minimum keepalive spacing
+#define SUSPECT_MISSES 3                 // unanswered keepalives before suspending a link
+#define READMIT_PROBES 2                 // answered keepalives before re-enabling it
+
+/* Capacity probing, see probe_select() */
+#define PROBE_UNDERUSED_DIV 4            // probe links with less than 1/4 of the largest window
+#define PROBE_WINDOW_INCR   WINDOW_MULT  // legacy window growth per ACKed packet while probing
+#define PROBE_CREDIT_MAX    (16 * MTU)   // bytes, largest probe burst
+#define PROBE_INFLIGHT_MIN  20           // packets, srtla_rec ACKs every 10
+#define PROBE_MAX_PCT_DEF   5
+
+/* Stale packet dropping, see pkt_is_stale() */
+#define SRT_TS_OFFSET_WIN   (10 * 1000 * 1000) // us, the clock offset is re-measured this often
+
+/* Encoder feedback, see feedback_tick() */
+#define FEEDBACK_INT        (200 * 1000)       // us
+#define FEEDBACK_HEADROOM   80                 // percent of the capacity recommended
+#define FEEDBACK_QDELAY_MAX (50 * 1000)        // us of queueing delay before a link counts as congested
+#define FEEDBACK_UP_HOLD    (2 * 1000 * 1000)  // us the capacity must stay higher before raising
+#define FEEDBACK_UP_STEP    10                 // percent, largest increase per message
+#define FEEDBACK_DOWN_HYST  5                  // percent, smaller drops are ignored
+#define FEEDBACK_MSG_SZ     4096
+
+/* Delivery rate estimation, see conn_rate_sample() */
+#define RATE_MIN_INT  (100 * 1000)       // us, minimum sampling interval
+#define BW_FILTER_LEN 10                 // samples kept by the max filter
+#define RTT_DEF       (100 * 1000)       // us, assumed RTT before the first sample
+#define AVG_PKT_SZ    1316               // typical SRT data packet size
+
+/* Congestion control, see conn_bbr_update(). Gains are in percent */
+typedef enum {
+  CC_LEGACY = 0,     // WINDOW_* additive increase / NAK decrease
+  CC_BBR             // delivery rate and min-RTT model
+} cc_mode;
+
+typedef enum {
+  BBR_STARTUP = 0,
+  BBR_DRAIN,
+  BBR_PROBE_BW
+} bbr_state;
+
+#define BBR_HIGH_GAIN     289  // 2/ln(2), doubles the sending rate every round
+#define BBR_CWND_GAIN     200
+#define BBR_FULL_BW_THRESH 125 // bw growth below which a round counts as flat
+#define BBR_FULL_BW_CNT   3
+#define BBR_CYCLE_LEN     8
+#define BBR_WINDOW_MIN    10   // srtla_rec only ACKs every RECV_ACK_INT (10) packets
+#define BBR_WINDOW_MAX    PKT_LOG_SZ // we can't track more packets in flight
+
+/* Packet classes, see classify_srt_pkt() */
+typedef enum {
+  PKT_DATA = 0,
+  PKT_RETRANS,
+  PKT_CONTROL,
+  PKT_CLASS_CNT
+} pkt_class;
+
+#define LOSS_PENALTY     10        // link cost multiplier per unit of loss rate
+
+/* Flowlet scheduling defaults, see flowlet_select() */
+#define FLOWLET_MAX_BYTES (32 * 1024)
+#define FLOWLET_MAX_MS    20
+
+/* Per-link pacing, see conn_send() */
+#define PACE_QUEUE_SZ  64
+#define PACE_GAIN      125           // pacing rate relative to the legacy bw estimate
+#define PACE_BURST     (5 * 1000)    // us worth of data that can be sent back to back
+#define PACE_MAX_WAIT  (200 * 1000)  // us, upper bound for the select() timeout
+
+typedef struct {
+  pkt_buf_t *pkt; // a reference held by the queue
+  int32_t sn;
+  uint64_t ts; // enqueue time
+} pace_pkt_t;
+
+/* Link schedulers */
+typedef enum {
+  SCHED_LEGACY = 0,  // window / in-flight ratio
+  SCHED_LATENCY      // earliest expected delivery time
+} sched_mode;
+
 typedef struct conn {
   struct conn *next;
+  struct stream *stream;
+  struct link *link;
+  struct conn *link_next; // the other streams' conns over the same link
   int fd;
   time_t last_rcvd;
   time_t last_sent;
+  uint64_t last_rcvd_us;
   struct sockaddr src;
   int removed;
   int in_flight_pkts;
+  int in_flight_bytes;
   int window;
   int pkt_idx;
   int pkt_log[PKT_LOG_SZ];
+  uint64_t pkt_ts[PKT_LOG_SZ]; // send timestamps of the pkt_log entries, in us
+  uint16_t pkt_len[PKT_LOG_SZ];
+  /* RTT estimates in us, 0 until the first sample */
+  int srtt;
+  int rttvar;
+  int min_rtt;
+  uint64_t min_rtt_ts;
+  /* delivery rate estimation, in bytes/s */
+  uint64_t rate_ts;
+  int rate_bytes;
+  int bw_idx;
+  int64_t bw_samples[BW_FILTER_LEN];
+  int64_t bw_est;
+  /* model-based congestion control state */
+  bbr_state bbr_state;
+  int64_t bbr_full_bw;
+  int bbr_full_bw_cnt;
+  int bbr_cycle_idx;
+  uint64_t bbr_cycle_ts;
+  int64_t pacing_rate; // bytes/s, 0 until the model has a bandwidth estimate
+  /* token bucket pacing */
+  int64_t pace_tokens; // bytes
+  uint64_t pace_ts;
+  pace_pkt_t *pace_q;
+  int pace_q_head;
+  int pace_q_len;
+  int pace_q_bytes;
+  uint64_t pace_delay_sum; // us, total queueing delay since the last stats print
+  uint64_t pace_delay_max;
+  int pace_delay_cnt;
+  int pace_overflows;
+  /* local socket send queue */
+  int outq_bytes;
+  uint64_t outq_ts;
+  int sndbuf;
+  /* SRT ACK copies suppressed after arriving over this link */
+  int dup_acks;
+  /* packets waiting for the next sendmmsg() */
+  int tx_cnt;
+  pkt_buf_t *tx_buf[IO_BATCH]; // referenced until the flush
+  int32_t tx_sn[IO_BATCH]; // -1 if not registered in pkt_log
+  /* transmit thread, only used with --threads */
+  struct link_worker *worker;
+  /* loss rate estimate, in permille, updated by housekeeping */
+  int loss_sent;
+  int loss_naks;
+  int loss_rate;
+  /* interface state reported by rtnetlink, see nl_handle() */
+  int ifindex; // 0 until known
+  int addr_gone;
+  int carrier_down;
+  int link_down; // either of the above, the link is not used while set
+  /* suspected failure, the link is only probed with keepalives while set */
+  int suspect;
+  int readmit_probes;
+  uint64_t suspect_since;
+  uint64_t last_ka_us;
+  int detect_cnt; // time from the last packet received to the suspicion
+  uint64_t detect_sum;
+  uint64_t detect_max;
+  /* capacity probing */
+  int probing;
+  int probe_pkts;
+  uint64_t last_probe_ts;
   /* reconnection/registration state */
   int reg_attempts;
   uint64_t next_reg_try_ms;
   int backoff_ms;
   conn_state cstate;
+  /* counters for the metrics endpoint, see metrics_fill() */
+  uint64_t sent_pkts;
+  uint64_t sent_bytes;
+  uint64_t rcvd_pkts;
+  uint64_t rcvd_bytes;
+  uint64_t send_errors;
+  uint64_t tx_drops; // the link thread's ring was full
+  uint64_t naks;
+  uint64_t ka_sent;
+  uint64_t ka_rcvd;
+  int ack_rtt; // us, the last SRTLA ACK sample
+  int ka_rtt;  // us, the last keepalive sample
 } conn_t;
 
+/* FEC encoder state, see fec_add() */
+typedef struct {
+  int cnt;
+  int maxlen;
+  uint16_t len_xor;
+  uint32_t sns[FEC_MAX_K];
+  conn_t *links[FEC_MAX_K];
+  char parity[MTU];
+} fec_tx_t;
+
+
+/* An SRT caller and the connection group that carries it to its receiver.
+   Each stream has its own conn_t, and socket, per link, see the Streams
+   section */
+typedef struct stream {
+  struct stream *next;
+  int weight;
+  int listen_port;
+  int listenfd;
+  struct sockaddr srt_addr;
+  char *srtla_host;
+  char *srtla_port;
+  struct sockaddr join_addrs[JOIN_MAX_ADDRS];
+  int join_addr_cnt;
+  struct sockaddr srtla_addr;
+  char srtla_id[SRTLA_ID_LEN];
+  int has_group; // we got a REG2 at some point
+  int reg_pending; // REG1s sent, waiting for a REG2
+  time_t pending_reg_timeout;
+  uint32_t reg_caps_offered;
+  int reg_caps_timeouts;
+  int fec_active;
+  int active_connections;
+  int has_connected;
+  int has_forwarded; // for logging the time to the first forwarded packet
+  uint64_t all_failed_at;
+  int gave_up;
+  /* flowlet scheduling, see flowlet_select() */
+  conn_t *flowlet_conn;
+  uint64_t flowlet_start;
+  uint64_t flowlet_last;
+  int flowlet_bytes;
+  fec_tx_t fec_tx;
+  /* newest SRT ACK forwarded, see srt_ack_is_dup() */
+  int has_ack;
+  uint32_t ack_dest_id;
+  uint32_t max_ack_no;
+  uint32_t max_ack_sn;
+  /* SRT timestamps to local time, see srt_ts_track() */
+  uint32_t srt_ts_offset; // local clock - SRT timestamp, in us, wrapping
+  uint32_t srt_ts_offset_next;
+  uint64_t srt_ts_offset_win;
+  int srt_ts_offset_valid;
+} stream_t;
+
+/* The conns of all the streams bound to the same source address */
+typedef struct link {
+  struct link *next;
+  struct sockaddr src;
+  conn_t *conns; // chained by link_next
+} link_t;
+
 char *source_ip_file = NULL;
 
 int do_update_conns = 0;
 
-struct addrinfo *addrs;
-
-struct sockaddr srtla_addr, srt_addr;
-const socklen_t addr_len = sizeof(srtla_addr);
-conn_t *conns = NULL;
-int listenfd;
-int active_connections = 0;
-int has_connected = 0;
+const socklen_t addr_len = sizeof(struct sockaddr);
+conn_t *conns = NULL; // of all the streams
+stream_t *streams = NULL;
+uint64_t startup_ms = 0;
+link_t *links = NULL;
 
 /* runtime flags */
 int flag_auto_reconnect = 1;
 int flag_log_errors = 0;
 int flag_reconnect_interval_ms = 500;
-
-conn_t *pending_reg2_conn = NULL;
-time_t pending_reg_timeout = 0;
-
-char srtla_id[SRTLA_ID_LEN];
+int flag_scheduler = SCHED_LEGACY;
+int flag_cc = CC_LEGACY;
+int flag_pacing = 0;
+int flag_adaptive_sndbuf = 0;
+int flag_threads = 0;
+int flag_flowlet = 0;
+int flag_flowlet_bytes = FLOWLET_MAX_BYTES;
+int flag_flowlet_ms = FLOWLET_MAX_MS;
+int flag_dup_retrans = 0;
+int flag_fec = 0;
+int flag_netlink = 1;
+int flag_probe = 0;
+int flag_probe_max_pct = PROBE_MAX_PCT_DEF;
+char *flag_feedback_sock = NULL;
+int flag_latency_budget_ms = 0;
+char *flag_metrics = NULL;
+
+int pkt_class_cnt[PKT_CLASS_CNT];
+const char *pkt_class_names[PKT_CLASS_CNT] = {"data", "retransmit", "control"};
+
+/* Capability negotiation. Receivers that predate it drop the extended REG1,
+   so we stop offering capabilities after FEC_REG_FALLBACK timed out tries */
+#define FEC_REG_FALLBACK 2
 
 
 /*
@@ -140,6 +423,339 @@ int remove_active_fd(int fd) {
 }
 
 
+/*
+
+Threaded mode
+
+With --threads, each link gets a transmit thread and the main thread only
+dispatches: it owns select_conn() and all the per-link bookkeeping, and
+hands the packets to the link threads over lock-free single-producer,
+single-consumer rings. The link threads also receive from their sockets and
+pass the packets back over a shared multi-producer, single-consumer queue,
+so a sendto() blocking on a wedged modem only stalls its own link.
+
+The link sockets are non-blocking in this mode, so the threads can always be
+stopped. Each ring has a wake-up pipe, which is only written to when the
+consumer may be sleeping (the 'wake' flag was clear)
+
+*/
+void handle_srtla_pkt(conn_t *c, char *buf, int n);
+void conn_xmit_failed(conn_t *c);
+
+#ifdef HAVE_THREADS
+typedef struct {
+  pkt_buf_t *pkt; // a reference, dropped by the link thread once sent
+  struct sockaddr addr;
+} tx_slot_t;
+
+typedef struct link_worker {
+  pthread_t thread;
+  conn_t *c;
+  int fd;
+  int wake_pipe[2];
+  atomic_int wake;
+  atomic_int stop;
+  /* transmit ring, produced by the main thread */
+  atomic_uint tx_head;
+  atomic_uint tx_tail;
+  tx_slot_t tx[TX_RING_SZ];
+  /* owned by the link thread, only read for the stats */
+  atomic_ullong tx_pkts;
+  atomic_ullong tx_bytes;
+  atomic_ullong tx_errors;
+  atomic_ullong rx_drops;
+} link_worker_t;
+
+/* The stats have a single writer, so they don't need an atomic add */
+#define worker_stat_add(p, v) \
+  atomic_store_explicit((p), atomic_load_explicit((p), memory_order_relaxed) + (v), \
+                        memory_order_relaxed)
+
+typedef struct {
+  atomic_uint seq;
+  conn_t *c;
+  pkt_buf_t *pkt; // a received packet, or NULL to report a send error
+} fb_slot_t;
+
+/* Feedback queue, a bounded MPSC ring with per-slot sequence numbers */
+fb_slot_t *fb_ring = NULL;
+atomic_uint fb_head;
+unsigned fb_tail = 0;
+atomic_int fb_wake;
+int fb_pipe[2] = {-1, -1};
+
+void wake_pipe_write(int fd) {
+  char b = 0;
+  int ret = write(fd, &b, 1);
+  (void)ret; // if the pipe is full, a wake-up is already pending
+}
+
+void wake_pipe_drain(int fd) {
+  char b[64];
+  while (read(fd, b, sizeof(b)) > 0);
+}
+
+/* Takes over the caller's reference to pkt, even if the queue is full */
+int fb_push(conn_t *c, pkt_buf_t *pkt) {
+  unsigned pos = atomic_load_explicit(&fb_head, memory_order_relaxed);
+  fb_slot_t *slot;
+  while (1) {
+    slot = &fb_ring[pos & (FB_RING_SZ - 1)];
+    unsigned seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    int diff = (int)(seq - pos);
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&fb_head, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      pkt_buf_unref(pkt);
+      return -1; // full
+    } else {
+      pos = atomic_load_explicit(&fb_head, memory_order_relaxed);
+    }
+  }
+
+  slot->c = c;
+  slot->pkt = pkt;
+  atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+
+  if (atomic_exchange(&fb_wake, 1) == 0) {
+    wake_pipe_write(fb_pipe[1]);
+  }
+  return 0;
+}
+
+/* Runs on the main thread: applies the feedback queued by the link threads */
+void fb_drain() {
+  if (fb_ring == NULL) return;
+
+  wake_pipe_drain(fb_pipe[0]);
+  atomic_store(&fb_wake, 0);
+
+  while (1) {
+    fb_slot_t *slot = &fb_ring[fb_tail & (FB_RING_SZ - 1)];
+    unsigned seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    if (seq != fb_tail + 1) break;
+
+    if (slot->pkt == NULL) {
+      conn_xmit_failed(slot->c);
+    } else {
+      handle_srtla_pkt(slot->c, slot->pkt->data, slot->pkt->len);
+      pkt_buf_unref(slot->pkt);
+    }
+
+    atomic_store_explicit(&slot->seq, fb_tail + FB_RING_SZ, memory_order_release);
+    fb_tail++;
+  }
+}
+
+int fb_init() {
+  fb_ring = malloc(sizeof(fb_slot_t) * FB_RING_SZ);
+  if (fb_ring == NULL) return -1;
+  for (unsigned i = 0; i < FB_RING_SZ; i++) {
+    atomic_init(&fb_ring[i].seq, i);
+  }
+  atomic_init(&fb_head, 0);
+  atomic_init(&fb_wake, 0);
+
+  if (pipe(fb_pipe) != 0) return -1;
+  fcntl(fb_pipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(fb_pipe[1], F_SETFL, O_NONBLOCK);
+  add_active_fd(fb_pipe[0]);
+
+  return 0;
+}
+
+/* Called from the main thread only, the ring takes a reference to pkt */
+int worker_tx_push(link_worker_t *w, pkt_buf_t *pkt, struct sockaddr *addr) {
+  unsigned tail = atomic_load_explicit(&w->tx_tail, memory_order_relaxed);
+  unsigned head = atomic_load_explicit(&w->tx_head, memory_order_acquire);
+  if (tail - head == TX_RING_SZ) return -1;
+
+  tx_slot_t *slot = &w->tx[tail & (TX_RING_SZ - 1)];
+  pkt_buf_ref(pkt);
+  slot->pkt = pkt;
+  slot->addr = *addr;
+  atomic_store_explicit(&w->tx_tail, tail + 1, memory_order_release);
+
+  if (atomic_exchange(&w->wake, 1) == 0) {
+    wake_pipe_write(w->wake_pipe[1]);
+  }
+  return 0;
+}
+
+/* Returns 1 if the socket buffer is full and packets are still pending */
+int worker_tx(link_worker_t *w) {
+  unsigned head = atomic_load_explicit(&w->tx_head, memory_order_relaxed);
+  unsigned tail = atomic_load_explicit(&w->tx_tail, memory_order_acquire);
+  for (; head != tail; head++) {
+    tx_slot_t *slot = &w->tx[head & (TX_RING_SZ - 1)];
+    int len = slot->pkt->len;
+    int ret = sendto(w->fd, slot->pkt->data, len, MSG_DONTWAIT, &slot->addr, addr_len);
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      atomic_store_explicit(&w->tx_head, head, memory_order_release);
+      return 1;
+    }
+    pkt_buf_unref(slot->pkt);
+    if (ret == len) {
+      worker_stat_add(&w->tx_pkts, 1);
+      worker_stat_add(&w->tx_bytes, ret);
+    } else {
+      worker_stat_add(&w->tx_errors, 1);
+      fb_push(w->c, NULL);
+    }
+  }
+  atomic_store_explicit(&w->tx_head, head, memory_order_release);
+  return 0;
+}
+
+void worker_rx(link_worker_t *w) {
+  for (int i = 0; i < IO_BATCH; i++) {
+    pkt_buf_t *pkt = pkt_buf_alloc();
+    if (pkt == NULL) return;
+    int n = recv(w->fd, pkt->data, MTU, MSG_DONTWAIT);
+    if (n <= 0) {
+      pkt_buf_unref(pkt);
+      return;
+    }
+    pkt->len = n;
+    if (fb_push(w->c, pkt) != 0) {
+      worker_stat_add(&w->rx_drops, 1);
+    }
+  }
+}
+
+void *worker_run(void *arg) {
+  link_worker_t *w = arg;
+  while (!atomic_load(&w->stop)) {
+    atomic_store(&w->wake, 0);
+    int blocked = worker_tx(w);
+
+    struct pollfd pfds[2] = {
+      {.fd = w->fd, .events = POLLIN | (blocked ? POLLOUT : 0)},
+      {.fd = w->wake_pipe[0], .events = POLLIN}
+    };
+    int ret = poll(pfds, 2, WORKER_POLL_MS);
+    if (ret <= 0) continue;
+
+    if (pfds[1].revents & POLLIN) {
+      wake_pipe_drain(w->wake_pipe[0]);
+    }
+    if (pfds[0].revents & POLLIN) {
+      worker_rx(w);
+    }
+  }
+  return NULL;
+}
+
+int conn_start_worker(conn_t *c) {
+  link_worker_t *w = calloc(1, sizeof(link_worker_t));
+  if (w == NULL) return -1;
+
+  w->c = c;
+  w->fd = c->fd;
+  if (pipe(w->wake_pipe) != 0) {
+    free(w);
+    return -1;
+  }
+  fcntl(w->wake_pipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(w->wake_pipe[1], F_SETFL, O_NONBLOCK);
+  fcntl(w->fd, F_SETFL, fcntl(w->fd, F_GETFL) | O_NONBLOCK);
+
+  if (pthread_create(&w->thread, NULL, worker_run, w) != 0) {
+    close(w->wake_pipe[0]);
+    close(w->wake_pipe[1]);
+    free(w);
+    return -1;
+  }
+
+  c->worker = w;
+  return 0;
+}
+
+/* Joins the link thread and applies any feedback it left behind, so the
+   feedback queue never refers to a conn_t that's about to be freed */
+void conn_stop_worker(conn_t *c) {
+  link_worker_t *w = c->worker;
+  if (w == NULL) return;
+
+  atomic_store(&w->stop, 1);
+  wake_pipe_write(w->wake_pipe[1]);
+  pthread_join(w->thread, NULL);
+  c->worker = NULL;
+  fb_drain();
+
+  // Drop the packets the thread didn't get to send
+  unsigned head = atomic_load(&w->tx_head);
+  unsigned tail = atomic_load(&w->tx_tail);
+  for (; head != tail; head++) {
+    pkt_buf_unref(w->tx[head & (TX_RING_SZ - 1)].pkt);
+  }
+
+  close(w->wake_pipe[0]);
+  close(w->wake_pipe[1]);
+  free(w);
+}
+#endif // HAVE_THREADS
+
+/* Set when a link thread's transmit ring is full. The link isn't
+   necessarily broken, its thread is just behind */
+#define CONN_TX_BUSY (-2)
+
+int conn_tx_busy(conn_t *c) {
+#ifdef HAVE_THREADS
+  link_worker_t *w = c->worker;
+  if (w) {
+    unsigned tail = atomic_load_explicit(&w->tx_tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&w->tx_head, memory_order_acquire);
+    return tail - head == TX_RING_SZ;
+  }
+#endif
+  return 0;
+}
+
+/* All the packets sent over a link go through here, so that in threaded mode
+   they're all sent by the link's thread */
+int conn_send_pkt(conn_t *c, pkt_buf_t *pkt) {
+#ifdef HAVE_THREADS
+  if (c->worker) {
+    return (worker_tx_push(c->worker, pkt, &c->stream->srtla_addr) == 0) ? pkt->len : CONN_TX_BUSY;
+  }
+#endif
+#ifdef _WIN32
+  return sendto(c->fd, (const char*)pkt->data, pkt->len, 0, &c->stream->srtla_addr, addr_len);
+#else
+  return sendto(c->fd, pkt->data, pkt->len, 0, &c->stream->srtla_addr, addr_len);
+#endif
+}
+
+// For our own small packets, which are only copied if a link thread sends them
+int conn_sendto_addr(conn_t *c, const void *buf, int len, struct sockaddr *addr) {
+#ifdef HAVE_THREADS
+  if (c->worker) {
+    pkt_buf_t *pkt = pkt_buf_alloc();
+    if (pkt == NULL) return -1;
+    memcpy(pkt->data, buf, len);
+    pkt->len = len;
+    int ret = worker_tx_push(c->worker, pkt, addr);
+    pkt_buf_unref(pkt);
+    return (ret == 0) ? len : -1;
+  }
+#endif
+#ifdef _WIN32
+  return sendto(c->fd, (const char*)buf, len, 0, addr, addr_len);
+#else
+  return sendto(c->fd, buf, len, 0, addr, addr_len);
+#endif
+}
+
+int conn_sendto(conn_t *c, const void *buf, int len) {
+  return conn_sendto_addr(c, buf, len, &c->stream->srtla_addr);
+}
+
+
 /*
 
 Misc helper functions
@@ -148,7 +764,35 @@ Misc helper functions
 void print_help() {
   fprintf(stderr,
           "Syntax: srtla_send SRT_LISTEN_PORT SRTLA_HOST SRTLA_PORT BIND_IPS_FILE\n\n"
-          "-v      Print the version and exit\n");
+          "-v      Print the version and exit\n"
+          "--stream LISTEN_PORT,SRTLA_HOST,SRTLA_PORT[,WEIGHT]\n"
+          "                            Carry another SRT stream over the same links\n"
+          "--weight N                  Share of the saturated links for the first\n"
+          "                            stream, relative to the others (default 1)\n"
+          "--scheduler legacy|latency  Link selection algorithm (default legacy)\n"
+          "--cc legacy|bbr             Per-link congestion control (default legacy)\n"
+          "--pacing                    Pace the packets sent over each link\n"
+          "--adaptive-sndbuf           Size each link's send buffer to its BDP\n"
+          "--threads                   Use a transmit thread per link\n"
+          "--flowlet                   Keep bursts of packets on the same link\n"
+          "--flowlet-bytes N           Maximum flowlet size (default 32768)\n"
+          "--flowlet-ms N              Maximum flowlet duration (default 20)\n"
+          "--dup-retrans               Send retransmissions and control packets over\n"
+          "                            the two best links\n"
+          "--fec K                     Send an XOR parity packet for every K data\n"
+          "                            packets, if the receiver supports it (max %d)\n"
+          "--no-netlink                Only detect failed links by timeouts (Linux)\n"
+          "--probe                     Probe the capacity of under-used links with\n"
+          "                            duplicate packets\n"
+          "--probe-max-pct N           Maximum probing overhead, in percent of the\n"
+          "                            data sent (default %d)\n"
+          "--feedback-sock PATH        Send bitrate recommendations to the encoder's\n"
+          "                            UNIX datagram socket at PATH\n"
+          "--latency-budget-ms N       Drop packets that can't reach the receiver\n"
+          "                            within N ms of leaving SRT\n"
+          "--metrics PATH|[IP:]PORT    Serve Prometheus metrics on a UNIX socket at\n"
+          "                            PATH, or a TCP port (on 127.0.0.1 by default)\n",
+          FEC_MAX_K, PROBE_MAX_PCT_DEF);
 }
 
 
@@ -157,17 +801,56 @@ void print_help() {
 srtla registration helpers
 
 */
-int send_reg1(conn_t *c) {
+/* The REG1 sent to the receiver's address idx carries our ID with idx
+   XORed into the last byte of our half. The receiver copies our half into
+   its REG2, which tells us which address answered */
+void join_id(stream_t *s, int idx, char *id) {
+  memcpy(id, s->srtla_id, SRTLA_ID_LEN);
+  id[SRTLA_ID_LEN/2 - 1] ^= idx;
+}
+
+int send_reg1(conn_t *c, int addr_idx) {
   if (c->fd < 0) return -1;
 
   char buf[MTU];
   uint16_t packet_type = htobe16(SRTLA_TYPE_REG1);
   memcpy(buf, &packet_type, sizeof(packet_type));
-  memcpy(buf + sizeof(packet_type), srtla_id, SRTLA_ID_LEN);
+  join_id(c->stream, addr_idx, buf + sizeof(packet_type));
+  int len = SRTLA_TYPE_REG1_LEN;
+
+  if (c->stream->reg_caps_offered) {
+    uint32_t caps = htobe32(c->stream->reg_caps_offered);
+    memcpy(buf + len, &caps, sizeof(caps));
+    len = SRTLA_TYPE_REG1_CAPS_LEN;
+  }
+
+  int ret = conn_sendto_addr(c, buf, len, &c->stream->join_addrs[addr_idx]);
+  if (ret != len) return -1;
+
+  return 0;
+}
 
-  int ret = sendto(c->fd, buf, SRTLA_TYPE_REG1_LEN, 0, &srtla_addr, addr_len);
-  if (ret != SRTLA_TYPE_REG1_LEN) return -1;
+/*
+  Joining: rather than registering the group over a single link and
+  waiting for a REG_NGP before sending REG1, REG1 is sent right away over
+  all the stream's links, to all the resolved addresses of the receiver.
+  The first REG2 wins, and its group is then joined by all the links with
+  REG2 as usual. The groups created by the other REG1s are dropped by
+  srtla_rec when their address registers to the winning group, or time out
+*/
+int stream_join(stream_t *s, time_t ts) {
+  int sent = 0;
+  for (conn_t *c = conns; c != NULL; c = c->next) {
+    if (c->stream != s || c->fd < 0 || c->link_down) continue;
+    for (int i = 0; i < s->join_addr_cnt; i++) {
+      if (send_reg1(c, i) == 0) sent++;
+    }
+  }
+  if (sent == 0) return -1;
 
+  debug("Sent %d REG1s to %d addresses\n", sent, s->join_addr_cnt);
+  s->reg_pending = 1;
+  s->pending_reg_timeout = ts + REG2_TIMEOUT;
   return 0;
 }
 
@@ -177,9 +860,9 @@ int send_reg2(conn_t *c) {
   char buf[SRTLA_TYPE_REG2_LEN];
   uint16_t packet_type = htobe16(SRTLA_TYPE_REG2);
   memcpy(buf, &packet_type, sizeof(packet_type));
-  memcpy(buf + sizeof(packet_type), srtla_id, SRTLA_ID_LEN);
+  memcpy(buf + sizeof(packet_type), c->stream->srtla_id, SRTLA_ID_LEN);
 
-  int ret = sendto(c->fd, buf, SRTLA_TYPE_REG2_LEN, 0, &srtla_addr, addr_len);
+  int ret = conn_sendto(c, buf, SRTLA_TYPE_REG2_LEN);
   return (ret == SRTLA_TYPE_REG2_LEN) ? 0 : -1;
 }
 
@@ -189,26 +872,214 @@ int send_reg2(conn_t *c) {
 Handling code for packets coming from the SRT caller
 
 */
-void reg_pkt(conn_t *c, int32_t packet) {
+void reg_pkt(conn_t *c, int32_t packet, int len, uint64_t ts) {
   debug("%s (%p): register packet %d at idx %d\n",
         print_addr(&c->src), c, packet, c->pkt_idx);
   c->pkt_log[c->pkt_idx] = packet;
+  c->pkt_ts[c->pkt_idx] = ts;
+  c->pkt_len[c->pkt_idx] = len;
   c->pkt_idx++;
   c->pkt_idx %= PKT_LOG_SZ;
 
   c->in_flight_pkts++;
+  c->in_flight_bytes += len;
+  c->loss_sent++;
+}
+
+// Undoes reg_pkt() for a packet that never made it onto the wire
+void unreg_pkt(conn_t *c, int32_t packet) {
+  for (int k = 1; k <= PKT_LOG_SZ; k++) {
+    int i = (c->pkt_idx - k + PKT_LOG_SZ) % PKT_LOG_SZ;
+    if (c->pkt_log[i] != packet) continue;
+
+    c->pkt_log[i] = -1;
+    c->in_flight_pkts = max(c->in_flight_pkts - 1, 0);
+    c->in_flight_bytes = max(c->in_flight_bytes - c->pkt_len[i], 0);
+    c->loss_sent = max(c->loss_sent - 1, 0);
+    return;
+  }
 }
 
 int conn_timed_out(conn_t *c, time_t ts) {
-  return (c->last_rcvd + CONN_TIMEOUT) < ts;
+  return c->link_down || (c->last_rcvd + CONN_TIMEOUT) < ts;
+}
+
+/* The measured delivery rate, or one derived from the window until we have
+   enough SRTLA ACKs to measure it */
+int64_t conn_window_rate(conn_t *c) {
+  int64_t rtt = c->srtt ? c->srtt : RTT_DEF;
+  return (int64_t)c->window * AVG_PKT_SZ / WINDOW_MULT * 1000 * 1000 / rtt;
+}
+
+int64_t conn_est_bw(conn_t *c) {
+  if (c->bw_est > 0) return c->bw_est;
+  return conn_window_rate(c);
+}
+
+/*
+  Streams share the links: their conns over the same source address go
+  through the same modem and queue behind each other. Each conn keeps its own
+  congestion control state, but the schedulers look at the link-wide totals
+  below. With a single stream they're the conn's own values
+*/
+int link_in_flight_pkts(link_t *l) {
+  int pkts = 0;
+  for (conn_t *c = l->conns; c != NULL; c = c->link_next) {
+    pkts += c->in_flight_pkts + c->pace_q_len;
+  }
+  return pkts;
+}
+
+int64_t link_in_flight_bytes(link_t *l) {
+  int64_t bytes = 0;
+  for (conn_t *c = l->conns; c != NULL; c = c->link_next) {
+    bytes += c->in_flight_bytes;
+  }
+  return bytes;
+}
+
+int64_t link_outq_bytes(link_t *l) {
+  int64_t bytes = 0;
+  for (conn_t *c = l->conns; c != NULL; c = c->link_next) {
+    bytes += c->outq_bytes;
+  }
+  return bytes;
+}
+
+int64_t link_est_bw(link_t *l) {
+  int64_t bw = 0;
+  for (conn_t *c = l->conns; c != NULL; c = c->link_next) {
+    bw += conn_est_bw(c);
+  }
+  return bw;
+}
+
+// The largest window of the streams, our best estimate of the link's
+int link_window(link_t *l) {
+  int window = 0;
+  for (conn_t *c = l->conns; c != NULL; c = c->link_next) {
+    window = max(window, c->window);
+  }
+  return window;
+}
+
+/*
+  Weighted allocation: while a link is saturated, a stream may only use its
+  weight's share of the link window, counted over the streams that are
+  currently using the link. Links that aren't saturated can be used freely
+*/
+int conn_over_share(conn_t *c, time_t t) {
+  if (c->link->conns == c && c->link_next == NULL) return 0;
+
+  int window = link_window(c->link);
+  if (link_in_flight_pkts(c->link) * WINDOW_MULT < window) return 0;
+
+  int weights = 0;
+  for (conn_t *i = c->link->conns; i != NULL; i = i->link_next) {
+    if (i == c || (!conn_timed_out(i, t) && i->in_flight_pkts > 0)) {
+      weights += i->stream->weight;
+    }
+  }
+
+  int64_t share = (int64_t)window * c->stream->weight / max(weights, 1);
+  return (int64_t)(c->in_flight_pkts + c->pace_q_len) * WINDOW_MULT >= share;
+}
+
+/*
+  The data still sitting in the link socket's send buffer. On Linux, this
+  is sampled with SIOCOUTQ at most every OUTQ_SAMPLE_INT. For UDP sockets
+  the kernel reports the memory charged to the socket, which includes some
+  per-packet overhead, so this slightly overestimates the payload bytes
+*/
+int conn_outq_bytes(conn_t *c, uint64_t ts) {
+#ifdef __linux__
+  if (c->fd >= 0 && (c->outq_ts + OUTQ_SAMPLE_INT) <= ts) {
+    int outq = 0;
+    if (ioctl(c->fd, SIOCOUTQ, &outq) == 0) {
+      c->outq_bytes = outq;
+    }
+    c->outq_ts = ts;
+  }
+#endif
+  return c->outq_bytes;
+}
+
+/* Expected time until a packet of len bytes sent now would arrive at the
+   receiver, in us: the one-way propagation delay plus the time needed to
+   drain the data queued ahead of it */
+int64_t conn_delivery_time(conn_t *c, int len, int64_t bw) {
+  bw = max(bw, 1);
+  int64_t base_rtt = c->min_rtt ? c->min_rtt : (c->srtt ? c->srtt : RTT_DEF);
+
+  /* in_flight_bytes also counts the data that's already on the wire (up to
+     one BDP), which doesn't delay new packets */
+  int64_t queued = link_in_flight_bytes(c->link) - bw * base_rtt / (1000 * 1000);
+  /* Data that hasn't even left our socket buffer is queued for sure. This
+     catches stalled links long before any NAKs or timeouts would */
+  queued = max(queued, link_outq_bytes(c->link));
+
+  return base_rtt / 2 + (queued + len) * 1000 * 1000 / bw;
+}
+
+int64_t conn_est_delivery(conn_t *c, int len) {
+  return conn_delivery_time(c, len, link_est_bw(c->link));
+}
+
+/* Higher is better */
+int64_t conn_score(conn_t *c, int len) {
+  switch (flag_scheduler) {
+    case SCHED_LATENCY:
+      return -conn_est_delivery(c, len + c->pace_q_bytes);
+
+    case SCHED_LEGACY:
+    default:
+      // Both link-wide, the in-flight count includes the other streams
+      return link_window(c->link) / (link_in_flight_pkts(c->link) +
+                                     link_outq_bytes(c->link) / AVG_PKT_SZ + 1);
+  }
+}
+
+/*
+  Flowlet scheduling: rather than choosing a link for every packet, keep
+  sending over the same link while the packets follow each other closely.
+  Switching links mid-burst reorders the packets at the receiver whenever the
+  new link is faster, which SRT turns into spurious NAKs. A flowlet ends when:
+  * it reaches flag_flowlet_bytes or lasts longer than flag_flowlet_ms
+  * its link runs out of window or becomes unusable
+  * a gap larger than half the RTT spread of the usable links separates two
+    packets, in which case switching can't cause reordering
+*/
+conn_t *flowlet_select(stream_t *s, conn_t *best, int usable, int rtt_spread, int len, uint64_t ts) {
+  conn_t *c = s->flowlet_conn;
+  if (c != NULL && usable &&
+      c->in_flight_pkts * WINDOW_MULT < c->window &&
+      (s->flowlet_bytes + len) <= flag_flowlet_bytes &&
+      (ts - s->flowlet_start) <= (uint64_t)flag_flowlet_ms * 1000 &&
+      (ts - s->flowlet_last) <= (uint64_t)(rtt_spread / 2)) {
+    s->flowlet_bytes += len;
+    s->flowlet_last = ts;
+    return c;
+  }
+
+  s->flowlet_conn = best;
+  s->flowlet_start = ts;
+  s->flowlet_last = ts;
+  s->flowlet_bytes = len;
+  return best;
 }
 
-conn_t *select_conn() {
+conn_t *select_conn(stream_t *s, int len) {
   conn_t *min_c = NULL;
-  int max_score = -1;
+  int64_t max_score = 0;
   int max_window = 0;
+  int flowlet_usable = 0;
+  int min_srtt = 0, max_srtt = 0;
+  conn_t *suspect_c = NULL;
+  conn_t *over_share_c = NULL;
+  conn_t *busy_c = NULL;
 
   for (conn_t *c = conns; c != NULL; c = c->next) {
+    if (c->stream != s) continue;
     if (c->window > max_window) {
       max_window = c->window;
     }
@@ -216,8 +1087,12 @@ conn_t *select_conn() {
 
   time_t t;
   assert(get_seconds(&t) == 0);
+  uint64_t ts;
+  get_us(&ts);
 
   for (conn_t *c = conns; c != NULL; c = c->next) {
+    if (c->stream != s) continue;
+
     /* If we have some very slow links, we may be better off ignoring them
        However, we'd probably need to periodically re-probe them, otherwise
        a link disabled due to a momentary glitch might not ever get enabled
@@ -233,11 +1108,45 @@ conn_t *select_conn() {
       continue;
     }
 
-    int score = c->window / (c->in_flight_pkts + 1);
-    if (score > max_score) {
+    // Suspected links are only used if nothing else is left
+    if (c->suspect) {
+      if (suspect_c == NULL) suspect_c = c;
+      continue;
+    }
+
+    // So are links whose thread can't keep up
+    if (conn_tx_busy(c)) {
+      if (busy_c == NULL) busy_c = c;
+      continue;
+    }
+
+    conn_outq_bytes(c, ts);
+
+    // Links where other streams are entitled to the remaining capacity
+    if (conn_over_share(c, t)) {
+      if (over_share_c == NULL) over_share_c = c;
+      continue;
+    }
+
+    int64_t score = conn_score(c, len);
+    if (min_c == NULL || score > max_score) {
       min_c = c;
       max_score = score;
     }
+
+    if (c == s->flowlet_conn) flowlet_usable = 1;
+    if (c->srtt > 0) {
+      min_srtt = (min_srtt == 0) ? c->srtt : min(min_srtt, c->srtt);
+      max_srtt = max(max_srtt, c->srtt);
+    }
+  }
+
+  if (flag_flowlet && min_c) {
+    min_c = flowlet_select(s, min_c, flowlet_usable, max_srtt - min_srtt, len, ts);
+  }
+
+  if (min_c == NULL) {
+    min_c = over_share_c ? over_share_c : (busy_c ? busy_c : suspect_c);
   }
 
   if (min_c) {
@@ -247,97 +1156,991 @@ conn_t *select_conn() {
   return min_c;
 }
 
-void handle_srt_data(int fd) {
-  char buf[MTU];
-  socklen_t len = sizeof(srt_addr);
-#ifdef _WIN32
-  int n = recvfrom(fd, (char*)buf, MTU, 0, (struct sockaddr*)&srt_addr, &len);
-#else
-  int n = recvfrom(fd, &buf, MTU, 0, &srt_addr, &len);
+/*
+
+Batched I/O
+
+On Linux, handle_srt_data() drains the listen socket with recvmmsg() and,
+while a batch is open, conn_xmit() only queues the packets, which are then
+sent with one sendmmsg() call per link by tx_batch_flush(). The packets are
+registered as in flight when they're queued, so select_conn() sees them.
+The queued packets are referenced until the flush
+
+*/
+int tx_batching = 0;
+int rx_batch_hist[BATCH_HIST_SZ];
+int tx_batch_hist[BATCH_HIST_SZ];
+
+void batch_hist_add(int *hist, int cnt) {
+  int bucket = 0;
+  while (bucket < (BATCH_HIST_SZ - 1) && cnt >= (2 << bucket)) bucket++;
+  hist[bucket]++;
+}
+
+void conn_xmit_failed(conn_t *c) {
+  /* If sending the packet fails, adjust the timestamp to disable the link until a
+     reconnection is confirmed. 1 so connection_housekeeping() prints its message */
+  c->last_rcvd = 1;
+  c->send_errors++;
+  err("%s (%p): sendto() failed, disabling the connection\n",
+      print_addr(&c->src), c);
+}
+
+#ifdef __linux__
+void conn_tx_flush(conn_t *c) {
+  if (c->tx_cnt == 0) return;
+
+  struct mmsghdr msgs[IO_BATCH];
+  struct iovec iovs[IO_BATCH];
+  memset(msgs, 0, sizeof(msgs[0]) * c->tx_cnt);
+  for (int i = 0; i < c->tx_cnt; i++) {
+    iovs[i].iov_base = c->tx_buf[i]->data;
+    iovs[i].iov_len = c->tx_buf[i]->len;
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_name = &c->stream->srtla_addr;
+    msgs[i].msg_hdr.msg_namelen = addr_len;
+  }
+
+  int ret = sendmmsg(c->fd, msgs, c->tx_cnt, 0);
+  batch_hist_add(tx_batch_hist, c->tx_cnt);
+  if (ret != c->tx_cnt) {
+    // The packets from the one that failed on weren't sent
+    for (int i = max(ret, 0); i < c->tx_cnt; i++) {
+      if (c->tx_sn[i] >= 0) unreg_pkt(c, c->tx_sn[i]);
+      c->sent_pkts--;
+      c->sent_bytes -= c->tx_buf[i]->len;
+    }
+    conn_xmit_failed(c);
+  }
+  for (int i = 0; i < c->tx_cnt; i++) {
+    pkt_buf_unref(c->tx_buf[i]);
+  }
+  c->tx_cnt = 0;
+}
 #endif
 
-  conn_t *c = select_conn();
-  if (c) {
-    int32_t sn = get_srt_sn(buf, n);
-#ifdef _WIN32
-    int ret = sendto(c->fd, (const char*)buf, n, 0, (struct sockaddr*)&srtla_addr, addr_len);
-#else
-    int ret = sendto(c->fd, &buf, n, 0, &srtla_addr, addr_len);
+void tx_batch_flush() {
+#ifdef __linux__
+  for (conn_t *c = conns; c != NULL; c = c->next) {
+    conn_tx_flush(c);
+  }
 #endif
-    if (ret == n) {
-      if (sn >= 0) {
-        reg_pkt(c, sn);
-      }
-    } else {
-      /* If sending the packet fails, adjust the timestamp to disable the link until a
-         reconnection is confirmed. 1 so connection_housekeeping() prints its message */
-      c->last_rcvd = 1;
-      err("%s (%p): sendto() failed, disabling the connection\n",
-          print_addr(&c->src), c);
+  tx_batching = 0;
+}
+
+int conn_xmit(conn_t *c, pkt_buf_t *pkt, int32_t sn, uint64_t ts) {
+  int n = pkt->len;
+#ifdef __linux__
+  if (tx_batching && c->worker == NULL) {
+    if (c->tx_cnt == IO_BATCH) {
+      conn_tx_flush(c);
+    }
+    pkt_buf_ref(pkt);
+    c->tx_buf[c->tx_cnt] = pkt;
+    c->tx_sn[c->tx_cnt] = sn;
+    c->tx_cnt++;
+    c->sent_pkts++;
+    c->sent_bytes += n;
+    if (sn >= 0) {
+      reg_pkt(c, sn, n, ts);
+    }
+    return 0;
+  }
+#endif
+
+  int ret = conn_send_pkt(c, pkt);
+  if (ret == n) {
+    c->sent_pkts++;
+    c->sent_bytes += n;
+    if (sn >= 0) {
+      reg_pkt(c, sn, n, ts);
     }
+    return 0;
+  }
+
+  /* Backpressure from a slow link: the packet is dropped, for SRT to
+     retransmit, but the link stays up */
+  if (ret == CONN_TX_BUSY) {
+    c->tx_drops++;
+    return 0;
   }
+
+  conn_xmit_failed(c);
+  return -1;
 }
 
 
 /*
 
-Handling code for packets coming from the receiver
+Stale packet dropping
+
+With --latency-budget-ms, data packets and retransmissions that can't
+reach the receiver within the budget are dropped instead of sent: the SRT
+receiver would discard them anyway, and meanwhile they'd delay fresher
+data. A packet's age is derived from its SRT timestamp, which counts
+microseconds since the SRT connection started. The offset between it and
+our clock is the smallest one seen over the last SRT_TS_OFFSET_WIN, so
+that fresh packets have an age of about 0 and clock drift is tracked. The
+expected delivery time is estimated like the latency scheduler does,
+including the link's pacing queue. Each stream is a separate SRT
+connection with its own timestamp base, so the offset is tracked per stream.
 
 */
-int get_pkt_idx(int idx, int increment) {
-  idx = idx + increment;
-  if (idx < 0) idx += PKT_LOG_SZ;
-  idx %= PKT_LOG_SZ;
-  assert(idx >= 0 && idx < PKT_LOG_SZ);
-  return idx;
+int stale_drops[PKT_CLASS_CNT];
+int stale_rescued = 0; // sent over another link rather than dropped
+uint64_t sent_age_max = 0; // us, oldest packet sent since the last stats print
+
+uint32_t srt_pkt_ts(char *buf) {
+  srt_header_t *hdr = (srt_header_t *)buf;
+  return be32toh(hdr->timestamp);
 }
 
-void register_nak(int32_t packet) {
-  for (conn_t *c = conns; c != NULL; c = c->next) {
-    int idx = get_pkt_idx(c->pkt_idx, -1);
-    for (int i = idx; i != c->pkt_idx; i = get_pkt_idx(i, -1)) {
-      if (c->pkt_log[i] == packet) {
-        c->pkt_log[i] = -1;
-        // It might be better to use exponential decay like this
-        //c->window = c->window * 998 / 1000;
-        c->window -= WINDOW_DECR;
-        c->window = max(c->window, WINDOW_MIN*WINDOW_MULT);
-        debug("%s (%p): found NAKed packet %d in the log\n",
-              print_addr(&c->src), c, packet);
-        return;
-      }
+void srt_ts_track(stream_t *s, char *buf, uint64_t ts) {
+  if (!flag_latency_budget_ms) return;
+
+  uint32_t offset = (uint32_t)ts - srt_pkt_ts(buf);
+  if (!s->srt_ts_offset_valid || (int32_t)(offset - s->srt_ts_offset) < 0) {
+    s->srt_ts_offset = offset;
+    s->srt_ts_offset_valid = 1;
+  }
+
+  if (ts >= s->srt_ts_offset_win + SRT_TS_OFFSET_WIN) {
+    // Adopt the smallest offset of the last window and start a new one
+    if (s->srt_ts_offset_win != 0) {
+      s->srt_ts_offset = s->srt_ts_offset_next;
     }
+    s->srt_ts_offset_next = offset;
+    s->srt_ts_offset_win = ts;
+  } else if ((int32_t)(offset - s->srt_ts_offset_next) < 0) {
+    s->srt_ts_offset_next = offset;
   }
+}
 
-  debug("Didn't find NAKed packet %d in our logs\n", packet);
+// us since the packet was handed to SRT, 0 if unknown
+uint64_t srt_pkt_age(stream_t *s, char *buf, uint64_t ts) {
+  if (!s->srt_ts_offset_valid) return 0;
+  int32_t age = (int32_t)((uint32_t)ts - srt_pkt_ts(buf) - s->srt_ts_offset);
+  return max(age, 0);
 }
 
-void register_srtla_ack(int32_t ack) {
-  int found = 0;
+/* The measured delivery rate is limited by what we sent, so dropping
+   packets would lower it further. Assume the link could also carry its
+   whole window, and only drop what's late even then */
+uint64_t conn_stale_eta(conn_t *c, int len) {
+  int64_t bw = max(link_est_bw(c->link), conn_window_rate(c));
+  return conn_delivery_time(c, len + c->pace_q_bytes, bw);
+}
 
-  for (conn_t *c = conns; c != NULL; c = c->next) {
-    int idx = get_pkt_idx(c->pkt_idx, -1);
-    for (int i = idx; i != c->pkt_idx && !found; i = get_pkt_idx(i, -1)) {
-      if (c->pkt_log[i] == ack) {
-        found = 1;
-        if (c->in_flight_pkts > 0) {
-          c->in_flight_pkts--;
-        }
+int pkt_is_stale(conn_t *c, char *buf, int len, uint64_t ts) {
+  // Without an RTT sample we know too little about the link to drop anything
+  if (!flag_latency_budget_ms || c->srtt == 0) return 0;
+
+  uint64_t age = srt_pkt_age(c->stream, buf, ts);
+  if (age + conn_stale_eta(c, len) > (uint64_t)flag_latency_budget_ms * 1000) return 1;
+
+  sent_age_max = max(sent_age_max, age);
+  return 0;
+}
+
+/* The link picked for a stale packet may just be the one that's backed up.
+   Returns the usable link of the stream that would deliver the packet the
+   earliest, if that one still meets the budget, or NULL if the packet
+   should be dropped */
+conn_t *stale_rescue_conn(conn_t *exclude, char *buf, int len, uint64_t ts) {
+  time_t t;
+  get_seconds(&t);
+
+  conn_t *best = NULL;
+  uint64_t best_eta = 0;
+  for (conn_t *c = conns; c != NULL; c = c->next) {
+    if (c->stream != exclude->stream || c == exclude) continue;
+    if (conn_timed_out(c, t) || c->suspect || conn_tx_busy(c) || c->srtt == 0) continue;
+
+    uint64_t eta = conn_stale_eta(c, len);
+    if (best == NULL || eta < best_eta) {
+      best = c;
+      best_eta = eta;
+    }
+  }
+
+  if (best == NULL || pkt_is_stale(best, buf, len, ts)) return NULL;
+  stale_rescued++;
+  best->last_sent = t;
+  return best;
+}
+
+/*
+
+Per-link pacing
+
+Each link has a token bucket filled at its pacing rate: the BBR pacing rate
+with --cc bbr, or PACE_GAIN times the measured delivery rate otherwise. Until
+a rate is known, packets are sent immediately. Packets that find the bucket
+empty wait in a small per-link queue, which pace_flush() drains from the main
+loop, so that keyframe bursts reach the modems at the rate they can take.
+
+*/
+int64_t conn_pacing_rate(conn_t *c) {
+  if (flag_cc == CC_BBR) return c->pacing_rate;
+  return c->bw_est * PACE_GAIN / 100;
+}
+
+void conn_pace_refill(conn_t *c, uint64_t ts) {
+  int64_t rate = conn_pacing_rate(c);
+  int64_t burst = max(rate * PACE_BURST / (1000 * 1000), 2 * MTU);
+  if (c->pace_ts != 0) {
+    c->pace_tokens += rate * (int64_t)(ts - c->pace_ts) / (1000 * 1000);
+  }
+  /* Bounded from below too, so that a burst sent over the limit can't
+     hold the link back for longer than one packet's worth of tokens */
+  c->pace_tokens = min(max(c->pace_tokens, -MTU), burst);
+  c->pace_ts = ts;
+}
+
+// Only debited once there's a rate, which is what pays the tokens back
+void conn_pace_debit(conn_t *c, int len) {
+  if (conn_pacing_rate(c) > 0) {
+    c->pace_tokens -= len;
+  }
+}
+
+void conn_pace_clear(conn_t *c) {
+  for (int i = 0; i < c->pace_q_len; i++) {
+    pkt_buf_unref(c->pace_q[(c->pace_q_head + i) % PACE_QUEUE_SZ].pkt);
+  }
+  c->pace_q_head = 0;
+  c->pace_q_len = 0;
+  c->pace_q_bytes = 0;
+  c->pace_tokens = 0;
+  c->pace_ts = 0;
+}
+
+int conn_send(conn_t *c, pkt_buf_t *pkt, int32_t sn);
+
+/* Sends the queued packets that the token bucket allows */
+void conn_pace_flush(conn_t *c, uint64_t ts) {
+  if (c->pace_q_len == 0) return;
+
+  conn_pace_refill(c, ts);
+  while (c->pace_q_len > 0) {
+    pace_pkt_t *p = &c->pace_q[c->pace_q_head];
+    pkt_buf_t *pkt = p->pkt;
+    if (c->pace_tokens < pkt->len && conn_pacing_rate(c) > 0) break;
+
+    uint64_t delay = ts - p->ts;
+    c->pace_delay_sum += delay;
+    c->pace_delay_max = max(c->pace_delay_max, delay);
+    c->pace_delay_cnt++;
+
+    c->pace_q_head = (c->pace_q_head + 1) % PACE_QUEUE_SZ;
+    c->pace_q_len--;
+    c->pace_q_bytes -= pkt->len;
+
+    // It may have become too late to send while it was waiting
+    if (pkt_is_stale(c, pkt->data, pkt->len, ts)) {
+      conn_t *alt = stale_rescue_conn(c, pkt->data, pkt->len, ts);
+      if (alt) {
+        conn_send(alt, pkt, p->sn);
+      } else {
+        stale_drops[PKT_DATA]++;
+      }
+      pkt_buf_unref(pkt);
+      continue;
+    }
+
+    conn_pace_debit(c, pkt->len);
+    int ret = conn_xmit(c, pkt, p->sn, ts);
+    pkt_buf_unref(pkt);
+    if (ret != 0) {
+      conn_pace_clear(c);
+      return;
+    }
+  }
+}
+
+void pace_flush(uint64_t ts) {
+  tx_batching = 1;
+  for (conn_t *c = conns; c != NULL; c = c->next) {
+    conn_pace_flush(c, ts);
+  }
+  tx_batch_flush();
+}
+
+/* How long until the next queued packet can be sent, in us */
+uint64_t pace_next_wait() {
+  uint64_t wait = PACE_MAX_WAIT;
+  for (conn_t *c = conns; c != NULL; c = c->next) {
+    if (c->pace_q_len == 0) continue;
+
+    int64_t rate = conn_pacing_rate(c);
+    int64_t needed = c->pace_q[c->pace_q_head].pkt->len - c->pace_tokens;
+    if (rate <= 0 || needed <= 0) return 0;
+    wait = min(wait, (uint64_t)(needed * 1000 * 1000 / rate) + 1);
+  }
+  return wait;
+}
+
+int conn_send(conn_t *c, pkt_buf_t *pkt, int32_t sn) {
+  uint64_t ts;
+  get_us(&ts);
+  int n = pkt->len;
+
+  if (!flag_pacing) {
+    return conn_xmit(c, pkt, sn, ts);
+  }
+
+  conn_pace_refill(c, ts);
+  if (c->pace_q_len == 0 && (c->pace_tokens >= n || conn_pacing_rate(c) <= 0)) {
+    conn_pace_debit(c, n);
+    return conn_xmit(c, pkt, sn, ts);
+  }
+
+  if (c->pace_q == NULL) {
+    c->pace_q = malloc(sizeof(pace_pkt_t) * PACE_QUEUE_SZ);
+  }
+  if (c->pace_q == NULL || c->pace_q_len == PACE_QUEUE_SZ) {
+    // Rather than dropping the packet, exceed the pacing rate
+    c->pace_overflows++;
+    return conn_xmit(c, pkt, sn, ts);
+  }
+
+  pace_pkt_t *p = &c->pace_q[(c->pace_q_head + c->pace_q_len) % PACE_QUEUE_SZ];
+  pkt_buf_ref(pkt);
+  p->pkt = pkt;
+  p->sn = sn;
+  p->ts = ts;
+  c->pace_q_len++;
+  c->pace_q_bytes += n;
+
+  return 0;
+}
+
+/*
+  SRT retransmissions (data packets with the R flag set) and control
+  packets (handshakes, ACKACKs, keepalives, shutdown) are time-critical:
+  a retransmission that lands on the slowest link may arrive after the SRT
+  latency deadline. These are classified here and sent over the link with
+  the lowest loss-weighted RTT, bypassing the scheduler and pacing
+*/
+pkt_class classify_srt_pkt(pkt_desc_t *d) {
+  if (d->type != PKT_T_SRT_DATA) return PKT_CONTROL;
+  if (d->retrans) return PKT_RETRANS;
+  return PKT_DATA;
+}
+
+int64_t conn_urgent_cost(conn_t *c) {
+  int64_t rtt = c->srtt ? c->srtt : RTT_DEF;
+  return rtt + rtt * c->loss_rate * LOSS_PENALTY / 1000;
+}
+
+conn_t *select_urgent_conn(stream_t *s, conn_t *exclude) {
+  time_t t;
+  get_seconds(&t);
+
+  conn_t *best = NULL;
+  int64_t best_cost = 0;
+  for (conn_t *c = conns; c != NULL; c = c->next) {
+    if (c->stream != s || c == exclude || conn_timed_out(c, t) || c->suspect) continue;
+
+    int64_t cost = conn_urgent_cost(c);
+    if (best == NULL || cost < best_cost) {
+      best = c;
+      best_cost = cost;
+    }
+  }
+
+  if (best) {
+    best->last_sent = t;
+  }
+
+  return best;
+}
+
+/*
+  Forward error correction
+
+  With --fec K and a receiver that accepted SRTLA_CAP_FEC, every K data
+  packets are followed by a parity packet: the XOR of their contents, sent
+  over a different link than the one that carried most of them. The
+  receiver can rebuild any single lost packet of the group without waiting
+  for an SRT retransmission, which matters when a link drops a burst right
+  before it gets marked as failed
+*/
+int fec_parity_sent = 0;
+int fec_parity_skipped = 0;
+
+void fec_reset(stream_t *s) {
+  s->fec_tx.cnt = 0;
+}
+
+conn_t *fec_busiest_link(stream_t *s) {
+  conn_t *busiest = NULL;
+  int busiest_cnt = 0;
+  for (int i = 0; i < s->fec_tx.cnt; i++) {
+    int cnt = 0;
+    for (int j = 0; j < s->fec_tx.cnt; j++) {
+      if (s->fec_tx.links[j] == s->fec_tx.links[i]) cnt++;
+    }
+    if (cnt > busiest_cnt) {
+      busiest = s->fec_tx.links[i];
+      busiest_cnt = cnt;
+    }
+  }
+  return busiest;
+}
+
+void fec_emit(stream_t *s) {
+  int k = s->fec_tx.cnt;
+  int hdr_len = SRTLA_FEC_HDR_LEN(k);
+  if (hdr_len + s->fec_tx.maxlen > MTU) {
+    fec_parity_skipped++;
+    fec_reset(s);
+    return;
+  }
+
+  pkt_buf_t *parity = pkt_buf_alloc();
+  if (parity == NULL) {
+    fec_parity_skipped++;
+    fec_reset(s);
+    return;
+  }
+  char *pkt = parity->data;
+  parity->len = hdr_len + s->fec_tx.maxlen;
+
+  srtla_fec_header_t *hdr = (srtla_fec_header_t *)pkt;
+  hdr->type = htobe16(SRTLA_TYPE_FEC);
+  hdr->k = k;
+  hdr->reserved = 0;
+  hdr->len_xor = htobe16(s->fec_tx.len_xor);
+  memcpy(hdr->sns, s->fec_tx.sns, k * sizeof(uint32_t));
+  memcpy(pkt + hdr_len, s->fec_tx.parity, s->fec_tx.maxlen);
+
+  conn_t *c = select_urgent_conn(s, fec_busiest_link(s));
+  if (c == NULL) {
+    c = select_urgent_conn(s, NULL);
+  }
+  if (c == NULL) {
+    fec_parity_skipped++;
+  } else {
+    uint64_t ts;
+    get_us(&ts);
+    if (conn_xmit(c, parity, -1, ts) == 0) {
+      fec_parity_sent++;
+    }
+  }
+  pkt_buf_unref(parity);
+
+  fec_reset(s);
+}
+
+void fec_add(conn_t *c, char *buf, int n, int32_t sn) {
+  stream_t *s = c->stream;
+  if (!s->fec_active || sn < 0) return;
+
+  if (s->fec_tx.cnt == 0) {
+    memset(s->fec_tx.parity, 0, sizeof(s->fec_tx.parity));
+    s->fec_tx.maxlen = 0;
+    s->fec_tx.len_xor = 0;
+  }
+
+  for (int i = 0; i < n; i++) {
+    s->fec_tx.parity[i] ^= buf[i];
+  }
+  s->fec_tx.maxlen = max(s->fec_tx.maxlen, n);
+  s->fec_tx.len_xor ^= n;
+  s->fec_tx.sns[s->fec_tx.cnt] = htobe32(sn);
+  s->fec_tx.links[s->fec_tx.cnt] = c;
+  s->fec_tx.cnt++;
+
+  if (s->fec_tx.cnt >= flag_fec) {
+    fec_emit(s);
+  }
+}
+
+/*
+  Capacity probing
+
+  A link whose window collapsed after a failure or a burst of NAKs only
+  regains it slowly, one ACK at a time, because the schedulers prefer the
+  links with larger windows. With --probe, data packets are duplicated over
+  links whose window is below 1/PROBE_UNDERUSED_DIV of the largest one.
+  srtla_rec ACKs the copies over the probed link, which feeds its delivery
+  rate estimate and, with --cc legacy, grows its window by a whole packet
+  per ACK until it's no longer under-used. A NAK ends the probing. The
+  probes are limited to --probe-max-pct percent of the data sent
+*/
+int probe_credit = 0;
+int probe_bytes = 0;
+
+void conn_probe_stop(conn_t *c) {
+  if (!c->probing) return;
+  c->probing = 0;
+  debug("%s (%p): done probing, window %d\n", print_addr(&c->src), c, c->window);
+}
+
+conn_t *probe_select(conn_t *sent_on, int len) {
+  probe_credit = min(probe_credit + len * flag_probe_max_pct / 100, PROBE_CREDIT_MAX);
+  if (probe_credit < len) return NULL;
+
+  time_t t;
+  get_seconds(&t);
+
+  int max_window = 0;
+  for (conn_t *c = conns; c != NULL; c = c->next) {
+    if (c->stream != sent_on->stream || conn_timed_out(c, t) || c->suspect) continue;
+    max_window = max(max_window, c->window);
+  }
+
+  conn_t *target = NULL;
+  for (conn_t *c = conns; c != NULL; c = c->next) {
+    if (c->stream != sent_on->stream || conn_timed_out(c, t) || c->suspect) continue;
+
+    if (c->window * PROBE_UNDERUSED_DIV >= max_window) {
+      conn_probe_stop(c);
+      continue;
+    }
+
+    /* Don't probe beyond twice the current window, but allow enough packets
+       in flight to trigger srtla_rec's batched ACKs */
+    int probe_max = max(c->window * 2, PROBE_INFLIGHT_MIN * WINDOW_MULT);
+    if (c == sent_on || c->in_flight_pkts * WINDOW_MULT >= probe_max) continue;
+
+    // Take turns between the under-used links
+    if (target == NULL || c->last_probe_ts < target->last_probe_ts) {
+      target = c;
+    }
+  }
+
+  if (target) {
+    probe_credit -= len;
+  }
+  return target;
+}
+
+void probe_send(conn_t *sent_on, pkt_buf_t *pkt, int32_t sn) {
+  int n = pkt->len;
+  conn_t *c = probe_select(sent_on, n);
+  if (c == NULL) return;
+
+  if (!c->probing) {
+    debug("%s (%p): probing, window %d\n", print_addr(&c->src), c, c->window);
+    c->probing = 1;
+  }
+  get_us(&c->last_probe_ts);
+  c->probe_pkts++;
+  probe_bytes += n;
+  conn_send(c, pkt, sn);
+}
+
+void dispatch_srt_pkt(stream_t *s, pkt_buf_t *pkt) {
+  char *buf = pkt->data;
+  int n = pkt->len;
+  pkt_desc_t d;
+  pkt_parse(&d, buf, n);
+  pkt_class cls = classify_srt_pkt(&d);
+  pkt_class_cnt[cls]++;
+  int32_t sn = d.sn;
+
+  uint64_t ts;
+  get_us(&ts);
+
+  if (cls == PKT_DATA) {
+    srt_ts_track(s, buf, ts);
+    conn_t *c = select_conn(s, n);
+    if (c && pkt_is_stale(c, buf, n, ts)) {
+      c = stale_rescue_conn(c, buf, n, ts);
+      if (c == NULL) {
+        stale_drops[cls]++;
+        return;
+      }
+    }
+    if (c) {
+      conn_send(c, pkt, sn);
+      fec_add(c, buf, n, sn);
+      if (flag_probe) {
+        probe_send(c, pkt, sn);
+      }
+      if (!s->has_forwarded) {
+        s->has_forwarded = 1;
+        info("Forwarded the first packet for port %d %d ms after startup\n",
+             s->listen_port, (int)(ts / 1000 - startup_ms));
+      }
+    }
+    return;
+  }
+
+  conn_t *c = select_urgent_conn(s, NULL);
+  if (c == NULL) return;
+  // Retransmissions keep their original timestamp
+  if (cls == PKT_RETRANS && pkt_is_stale(c, buf, n, ts)) {
+    c = stale_rescue_conn(c, buf, n, ts);
+    if (c == NULL) {
+      stale_drops[cls]++;
+      return;
+    }
+  }
+  conn_xmit(c, pkt, sn, ts);
+
+  if (flag_dup_retrans) {
+    conn_t *c2 = select_urgent_conn(s, c);
+    if (c2) {
+      conn_xmit(c2, pkt, sn, ts);
+    }
+  }
+}
+
+#ifdef __linux__
+void handle_srt_data(stream_t *s) {
+  // Kept between calls, the packets that were received are replaced
+  static pkt_buf_t *bufs[IO_BATCH];
+  struct sockaddr addrs[IO_BATCH];
+  struct mmsghdr msgs[IO_BATCH];
+  struct iovec iovs[IO_BATCH];
+
+  memset(msgs, 0, sizeof(msgs));
+  int batch = 0;
+  for (; batch < IO_BATCH; batch++) {
+    int i = batch;
+    if (bufs[i] == NULL) bufs[i] = pkt_buf_alloc();
+    if (bufs[i] == NULL) break;
+    iovs[i].iov_base = bufs[i]->data;
+    iovs[i].iov_len = MTU;
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_name = &addrs[i];
+    msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+  }
+
+  if (batch == 0) return;
+  int cnt = recvmmsg(s->listenfd, msgs, batch, MSG_DONTWAIT, NULL);
+  if (cnt <= 0) return;
+  batch_hist_add(rx_batch_hist, cnt);
+
+  /* Select the links for the whole batch, then send each link's share at
+     once. The order of the packets sent over each link is preserved */
+  tx_batching = 1;
+  for (int i = 0; i < cnt; i++) {
+    int n = msgs[i].msg_len;
+    s->srt_addr = addrs[i];
+    if (n <= 0) continue;
+
+    bufs[i]->len = n;
+    dispatch_srt_pkt(s, bufs[i]);
+    pkt_buf_unref(bufs[i]);
+    bufs[i] = NULL;
+  }
+  tx_batch_flush();
+}
+#else
+void handle_srt_data(stream_t *s) {
+  pkt_buf_t *pkt = pkt_buf_alloc();
+  if (pkt == NULL) return;
+
+  socklen_t len = sizeof(s->srt_addr);
+#ifdef _WIN32
+  int n = recvfrom(s->listenfd, (char*)pkt->data, MTU, 0, (struct sockaddr*)&s->srt_addr, &len);
+#else
+  int n = recvfrom(s->listenfd, pkt->data, MTU, 0, &s->srt_addr, &len);
+#endif
+
+  if (n > 0) {
+    pkt->len = n;
+    dispatch_srt_pkt(s, pkt);
+  }
+  pkt_buf_unref(pkt);
+}
+#endif
+
+
+/*
+
+Handling code for packets coming from the receiver
+
+*/
+/*
+  srtla_rec broadcasts SRT ACKs over all links, and a slow link can deliver
+  its copy long after the others. Only the first copy is forwarded: the ACK
+  number (the type-specific info of the header) grows with every full ACK,
+  so an ACK that isn't newer than the highest one forwarded is a duplicate,
+  or outdated anyway. Light ACKs have no number and are compared by the
+  last acknowledged packet instead. Both wrap around. A new SRT connection,
+  with another destination socket ID, starts counting again
+*/
+int srt_ack_is_dup(stream_t *s, char *buf, uint32_t ack_no, uint32_t last_ack) {
+  uint32_t dest_id = be32toh(((srt_header_t *)buf)->dest_id);
+  if (!s->has_ack || dest_id != s->ack_dest_id) {
+    s->has_ack = 1;
+    s->ack_dest_id = dest_id;
+    s->max_ack_no = ack_no;
+    s->max_ack_sn = last_ack;
+    return 0;
+  }
+
+  int32_t sn_dist = (last_ack - s->max_ack_sn) & 0x7FFFFFFF;
+  int sn_newer = sn_dist != 0 && sn_dist < 0x40000000;
+  if (ack_no != 0) {
+    if ((int32_t)(ack_no - s->max_ack_no) <= 0) return 1;
+    s->max_ack_no = ack_no;
+  } else if (!sn_newer) {
+    return 1;
+  }
+
+  if (sn_newer) s->max_ack_sn = last_ack;
+  return 0;
+}
+
+int get_pkt_idx(int idx, int increment) {
+  idx = idx + increment;
+  if (idx < 0) idx += PKT_LOG_SZ;
+  idx %= PKT_LOG_SZ;
+  assert(idx >= 0 && idx < PKT_LOG_SZ);
+  return idx;
+}
+
+void register_nak(stream_t *s, int32_t packet) {
+  for (conn_t *c = conns; c != NULL; c = c->next) {
+    if (c->stream != s) continue;
+
+    int idx = get_pkt_idx(c->pkt_idx, -1);
+    for (int i = idx; i != c->pkt_idx; i = get_pkt_idx(i, -1)) {
+      if (c->pkt_log[i] == packet) {
         c->pkt_log[i] = -1;
+        c->loss_naks++;
+        c->naks++;
+        conn_probe_stop(c);
+        /* The model-based controller doesn't treat losses as a congestion
+           signal, the delivery rate already reflects them */
+        if (flag_cc == CC_LEGACY) {
+          // It might be better to use exponential decay like this
+          //c->window = c->window * 998 / 1000;
+          c->window -= WINDOW_DECR;
+          c->window = max(c->window, WINDOW_MIN*WINDOW_MULT);
+        }
+        debug("%s (%p): found NAKed packet %d in the log\n",
+              print_addr(&c->src), c, packet);
+        return;
+      }
+    }
+  }
+
+  debug("Didn't find NAKed packet %d in our logs\n", packet);
+}
+
+/*
+  Smoothed RTT and RTT variance as in RFC 6298, plus a windowed min-RTT
+  The samples come from SRTLA ACKs and from our timestamped keepalives
+*/
+void conn_update_rtt(conn_t *c, int64_t rtt, uint64_t ts) {
+  if (rtt < 0 || rtt > RTT_MAX) return;
+  rtt = max(rtt, 1);
+
+  if (c->srtt == 0) {
+    c->srtt = rtt;
+    c->rttvar = rtt / 2;
+  } else {
+    int delta = c->srtt - rtt;
+    if (delta < 0) delta = -delta;
+    c->rttvar = (3 * c->rttvar + delta) / 4;
+    c->srtt = (7 * c->srtt + rtt) / 8;
+  }
+
+  if (c->min_rtt == 0 || rtt <= c->min_rtt || (c->min_rtt_ts + MIN_RTT_WIN) < ts) {
+    c->min_rtt = rtt;
+    c->min_rtt_ts = ts;
+  }
 
-        if (c->in_flight_pkts*WINDOW_MULT > c->window) {
+  debug("%s (%p): rtt sample %d us, srtt %d us, rttvar %d us, min rtt %d us\n",
+        print_addr(&c->src), c, (int)rtt, c->srtt, c->rttvar, c->min_rtt);
+}
+
+void conn_reset_rtt(conn_t *c) {
+  c->srtt = 0;
+  c->rttvar = 0;
+  c->min_rtt = 0;
+  c->min_rtt_ts = 0;
+}
+
+void conn_bbr_update(conn_t *c, uint64_t ts);
+
+/*
+  Delivery rate sampling: the bytes acknowledged by SRTLA or SRT ACKs are accumulated
+  over at least RATE_MIN_INT (or one smoothed RTT, if longer) and the resulting
+  rate is fed into a max filter over the last BW_FILTER_LEN samples. The max
+  filter keeps application-limited periods from dragging the estimate down
+*/
+void conn_rate_sample(conn_t *c, int acked_bytes, uint64_t ts) {
+  if (c->rate_ts == 0) {
+    c->rate_ts = ts;
+    c->rate_bytes = 0;
+    return;
+  }
+
+  c->rate_bytes += acked_bytes;
+
+  uint64_t interval = ts - c->rate_ts;
+  if (interval < max(RATE_MIN_INT, (uint64_t)c->srtt)) {
+    // DRAIN ends as soon as the queue is gone, not at the next sample
+    if (flag_cc == CC_BBR && c->bbr_state == BBR_DRAIN) {
+      conn_bbr_update(c, ts);
+    }
+    return;
+  }
+
+  int64_t rate = (int64_t)c->rate_bytes * 1000 * 1000 / interval;
+  c->bw_samples[c->bw_idx] = rate;
+  c->bw_idx = (c->bw_idx + 1) % BW_FILTER_LEN;
+
+  c->bw_est = 0;
+  for (int i = 0; i < BW_FILTER_LEN; i++) {
+    c->bw_est = max(c->bw_est, c->bw_samples[i]);
+  }
+
+  c->rate_ts = ts;
+  c->rate_bytes = 0;
+
+  if (flag_cc == CC_BBR) {
+    conn_bbr_update(c, ts);
+  }
+}
+
+void conn_reset_rate(conn_t *c) {
+  c->rate_ts = 0;
+  c->rate_bytes = 0;
+  c->bw_idx = 0;
+  c->bw_est = 0;
+  memset(c->bw_samples, 0, sizeof(c->bw_samples));
+
+  c->bbr_state = BBR_STARTUP;
+  c->bbr_full_bw = 0;
+  c->bbr_full_bw_cnt = 0;
+  c->bbr_cycle_idx = 0;
+  c->bbr_cycle_ts = 0;
+  c->pacing_rate = 0;
+}
+
+/*
+  Model-based congestion control in the style of BBR, run on each new
+  delivery rate sample. The bottleneck bandwidth is bw_est (a max filter)
+  and the propagation delay is min_rtt. The window is set to a multiple of
+  their product and the pacing rate to a multiple of the bandwidth:
+
+  STARTUP:  high gain until the bandwidth stops growing for BBR_FULL_BW_CNT
+            samples
+  DRAIN:    low pacing gain until the queue built in STARTUP is gone
+  PROBE_BW: cycle the pacing gain through 5/4, 3/4 and 1 to probe for more
+            bandwidth and then drain the queue that probing created
+*/
+static const int bbr_pacing_gain[BBR_CYCLE_LEN] = {125, 75, 100, 100, 100, 100, 100, 100};
+
+void conn_bbr_update(conn_t *c, uint64_t ts) {
+  if (c->bw_est <= 0 || c->min_rtt <= 0) return;
+
+  /* srtla_rec only ACKs every RECV_ACK_INT packets, so fewer than
+     BBR_WINDOW_MIN packets in flight can't be told apart from an empty
+     pipe. Without this floor, DRAIN never ends on short RTTs */
+  int64_t bdp = max(c->bw_est * c->min_rtt / (1000 * 1000),
+                    (int64_t)BBR_WINDOW_MIN * AVG_PKT_SZ);
+  int pacing_gain = 100;
+  int cwnd_gain = BBR_CWND_GAIN;
+
+  switch (c->bbr_state) {
+    case BBR_STARTUP:
+      if (c->bw_est * 100 >= c->bbr_full_bw * BBR_FULL_BW_THRESH) {
+        c->bbr_full_bw = c->bw_est;
+        c->bbr_full_bw_cnt = 0;
+      } else if (++c->bbr_full_bw_cnt >= BBR_FULL_BW_CNT) {
+        debug("%s (%p): bbr: bandwidth plateau at %lld B/s, draining\n",
+              print_addr(&c->src), c, (long long)c->bw_est);
+        c->bbr_state = BBR_DRAIN;
+      }
+      pacing_gain = BBR_HIGH_GAIN;
+      cwnd_gain = BBR_HIGH_GAIN;
+      break;
+
+    case BBR_DRAIN:
+      pacing_gain = 100 * 100 / BBR_HIGH_GAIN;
+      cwnd_gain = BBR_HIGH_GAIN;
+      if (c->in_flight_bytes <= bdp) {
+        c->bbr_state = BBR_PROBE_BW;
+        c->bbr_cycle_idx = 0;
+        c->bbr_cycle_ts = ts;
+        pacing_gain = bbr_pacing_gain[0];
+        cwnd_gain = BBR_CWND_GAIN;
+      }
+      break;
+
+    case BBR_PROBE_BW:
+      if ((ts - c->bbr_cycle_ts) > (uint64_t)c->min_rtt) {
+        c->bbr_cycle_idx = (c->bbr_cycle_idx + 1) % BBR_CYCLE_LEN;
+        c->bbr_cycle_ts = ts;
+      }
+      pacing_gain = bbr_pacing_gain[c->bbr_cycle_idx];
+      break;
+  }
+
+  c->pacing_rate = c->bw_est * pacing_gain / 100;
+
+  int64_t cwnd = bdp * cwnd_gain / 100;
+  int64_t window = cwnd * WINDOW_MULT / AVG_PKT_SZ;
+  c->window = min_max(window, BBR_WINDOW_MIN * WINDOW_MULT, BBR_WINDOW_MAX * WINDOW_MULT);
+}
+
+int conn_register_srtla_ack(conn_t *c, int32_t ack, uint64_t ts, int64_t *rtt) {
+  int idx = get_pkt_idx(c->pkt_idx, -1);
+  for (int i = idx; i != c->pkt_idx; i = get_pkt_idx(i, -1)) {
+    if (c->pkt_log[i] == ack) {
+      *rtt = (int64_t)(ts - c->pkt_ts[i]);
+      if (c->in_flight_pkts > 0) {
+        c->in_flight_pkts--;
+      }
+      c->in_flight_bytes = max(c->in_flight_bytes - c->pkt_len[i], 0);
+      conn_rate_sample(c, c->pkt_len[i], ts);
+      c->pkt_log[i] = -1;
+
+      if (flag_cc == CC_LEGACY) {
+        if (c->probing) {
+          // A link being probed grows by a packet per ACKed packet, like slow start
+          c->window += PROBE_WINDOW_INCR - 1;
+        } else if (c->in_flight_pkts*WINDOW_MULT > c->window) {
           c->window += WINDOW_INCR - 1;
         }
-
-        break;
       }
+
+      return 1;
     }
+  }
+
+  return 0;
+}
+
+/*
+  Returns the connection that sent the packet, or NULL if it's not in our logs
+  *rtt is set to the time elapsed since the packet was sent, in us
+  The link the ACK arrived over is checked first, because with --probe the
+  same packet can be in flight over two links
+*/
+conn_t *register_srtla_ack(conn_t *from, int32_t ack, uint64_t ts, int64_t *rtt) {
+  conn_t *found = NULL;
+  if (conn_register_srtla_ack(from, ack, ts, rtt)) {
+    found = from;
+  }
 
-    if (c->last_rcvd != 0) {
+  // The sequence numbers are per stream
+  for (conn_t *c = conns; c != NULL; c = c->next) {
+    if (c->stream != from->stream) continue;
+
+    if (!found && c != from && conn_register_srtla_ack(c, ack, ts, rtt)) {
+      found = c;
+    }
+
+    if (flag_cc == CC_LEGACY && c->last_rcvd != 0) {
       c->window += 1;
       c->window = min(c->window, WINDOW_MAX*WINDOW_MULT);
     }
   }
+
+  return found;
 }
 
 /*
@@ -346,130 +2149,223 @@ void register_srtla_ack(int32_t ack) {
   ACKs acknowledge each packet individually. Also, if the SRTLA ACK is lost,
   stale entries will be overwritten soon enough as pkt_log is a circular buffer
 */
-void conn_register_srt_ack(conn_t *c, int32_t ack) {
+void conn_register_srt_ack(conn_t *c, int32_t ack, uint64_t ts) {
   int count = 0;
+  int bytes = 0;
+  int acked_bytes = 0;
   int idx = get_pkt_idx(c->pkt_idx, -1);
   for (int i = idx; i != c->pkt_idx; i = get_pkt_idx(i, -1)) {
     if (c->pkt_log[i] < ack) {
+      /* Packets that the SRT ACK beat the SRTLA ACK to were still delivered */
+      if (c->pkt_log[i] >= 0) {
+        acked_bytes += c->pkt_len[i];
+      }
       c->pkt_log[i] = -1;
     } else {
       count++;
+      bytes += c->pkt_len[i];
     }
   }
   c->in_flight_pkts = count;
+  c->in_flight_bytes = bytes;
+
+  if (acked_bytes > 0) {
+    conn_rate_sample(c, acked_bytes, ts);
+  }
 }
 
-void register_srt_ack(int32_t ack) {
+void register_srt_ack(stream_t *s, int32_t ack, uint64_t ts) {
   for (conn_t *c = conns; c != NULL; c = c->next) {
-    conn_register_srt_ack(c, ack);
+    if (c->stream != s) continue;
+    conn_register_srt_ack(c, ack, ts);
   }
 }
 
 void handle_srtla_data(conn_t *c) {
-  char buf[MTU];
+  pkt_buf_t *pkt = pkt_buf_alloc();
+  if (pkt == NULL) return;
+
 #ifdef _WIN32
-  int n = recvfrom(c->fd, (char*)buf, MTU, 0, NULL, NULL);
+  int n = recvfrom(c->fd, (char*)pkt->data, MTU, 0, NULL, NULL);
 #else
-  int n = recvfrom(c->fd, &buf, MTU, 0, NULL, NULL);
+  int n = recvfrom(c->fd, pkt->data, MTU, 0, NULL, NULL);
 #endif
-  if (n <= 0) return;
+  if (n > 0) {
+    handle_srtla_pkt(c, pkt->data, n);
+  }
+  pkt_buf_unref(pkt);
+}
 
+void handle_srtla_pkt(conn_t *c, char *buf, int n) {
+  stream_t *s = c->stream;
   time_t ts;
   get_seconds(&ts);
+  uint64_t ts_us;
+  get_us(&ts_us);
 
-  uint16_t packet_type = get_srt_type(buf, n);
+  pkt_desc_t d;
+  pkt_parse(&d, buf, n);
+  c->rcvd_pkts++;
+  c->rcvd_bytes += n;
+  if (d.type == PKT_T_INVALID) return;
 
   /* Handling NGPs separately because we don't want them to update last_rcvd
      Otherwise they could be keeping failed connections marked active */
-  if (packet_type == SRTLA_TYPE_REG_NGP) {
+  if (d.type == PKT_T_SRTLA_REG_NGP) {
     /* Only process NGPs if:
        * we don't have any established connections
        * and we don't already have a pending REG1->REG2 exhange in flight
        * and we don't have any pending REG2->REG3 exchanges in flight
     */
-    if (active_connections == 0 && pending_reg2_conn == NULL && ts > pending_reg_timeout) {
-      if (send_reg1(c) == 0) {
-        pending_reg2_conn = c;
-        pending_reg_timeout = ts + REG2_TIMEOUT;
-      }
+    if (s->active_connections == 0 && !s->reg_pending && ts > s->pending_reg_timeout) {
+      stream_join(s, ts);
     }
     return;
 
-  } else if (packet_type == SRTLA_TYPE_REG2) {
-    if (pending_reg2_conn == c) {
+  } else if (d.type == PKT_T_SRTLA_REG2) {
+    if (s->reg_pending) {
       char *id = &buf[2];
-      if (memcmp(id, srtla_id, SRTLA_ID_LEN/2) != 0) {
+      int addr_idx;
+      for (addr_idx = 0; addr_idx < s->join_addr_cnt; addr_idx++) {
+        char join[SRTLA_ID_LEN];
+        join_id(s, addr_idx, join);
+        if (memcmp(id, join, SRTLA_ID_LEN/2) == 0) break;
+      }
+      if (addr_idx == s->join_addr_cnt) {
         err("%s (%p): got a mismatching ID in SRTLA_REG2\n",
            print_addr(&c->src), c);
         return;
       }
 
-      info("%s (%p): connection group registered\n", print_addr(&c->src), c);
-      memcpy(srtla_id, id, SRTLA_ID_LEN);
+      uint64_t ms;
+      get_ms(&ms);
+      s->srtla_addr = s->join_addrs[addr_idx];
+      info("%s (%p): connection group registered %d ms after startup\n",
+           print_addr(&c->src), c, (int)(ms - startup_ms));
+      memcpy(s->srtla_id, id, SRTLA_ID_LEN);
+      s->has_group = 1;
+
+      uint32_t caps = 0;
+      if (n >= SRTLA_TYPE_REG2_CAPS_LEN) {
+        memcpy(&caps, &buf[SRTLA_TYPE_REG2_LEN], sizeof(caps));
+        caps = be32toh(caps) & s->reg_caps_offered;
+      }
+      s->reg_caps_timeouts = 0;
+      fec_reset(s);
+      s->fec_active = (caps & SRTLA_CAP_FEC) != 0;
+      if (flag_fec) {
+        info("FEC %s\n", s->fec_active ? "enabled" : "not supported by the receiver");
+      }
 
       /* Broadcast REG2 */
       for (conn_t *i = conns; i != NULL; i = i->next) {
-        send_reg2(i);
+        if (i->stream == s) send_reg2(i);
       }
 
-      pending_reg2_conn = NULL;
-      pending_reg_timeout = ts + REG3_TIMEOUT;
+      s->reg_pending = 0;
+      s->pending_reg_timeout = ts + REG3_TIMEOUT;
     }
     return;
   }
 
   c->last_rcvd = ts;
+  c->last_rcvd_us = ts_us;
+
+  switch(d.type) {
+    case PKT_T_SRT_ACK: {
+      /* Only the first copy is passed on to the SRT caller and our own
+         ACK bookkeeping, the others carry no new information */
+      if (srt_ack_is_dup(s, buf, d.ack_no, d.ack_sn)) {
+        c->dup_acks++;
+        return;
+      }
 
-  switch(packet_type) {
-    case SRT_TYPE_ACK: {
-      uint32_t last_ack = *((uint32_t *)&buf[16]);
-      last_ack = be32toh(last_ack);
-      register_srt_ack(last_ack);
+      register_srt_ack(s, d.ack_sn, ts_us);
       break;
     }
 
-    case SRT_TYPE_NAK: {
-      uint32_t *ids = (uint32_t *)buf;
+    case PKT_T_SRT_NAK: {
       for (int i = 4; i < n/4; i++) {
-        uint32_t id = be32toh(ids[i]);
+        uint32_t id = pkt_be32(buf, i * 4);
         if (id & (1 << 31)) {
+          if (i + 1 >= n/4) break; // truncated range
           id = id & 0x7FFFFFFF;
-          uint32_t last_id = be32toh(ids[i+1]);
-          for (int32_t lost = id; lost <= last_id; lost++) {
-            register_nak(lost);
+          uint32_t last_id = pkt_be32(buf, (i + 1) * 4);
+          /* Sequence numbers wrap at 2^31. A range longer than the packet
+             log can't be found in it anyway */
+          uint32_t cnt = ((last_id - id) & 0x7FFFFFFF) + 1;
+          cnt = min(cnt, PKT_LOG_SZ);
+          for (uint32_t j = 0; j < cnt; j++) {
+            register_nak(s, (id + j) & 0x7FFFFFFF);
           }
           i++;
         } else {
-          register_nak(id);
+          register_nak(s, id);
         }
       }
       break;
     }
 
     // srtla packets below, don't send to SRT
-    case SRTLA_TYPE_ACK: {
-      uint32_t *acks = (uint32_t *)buf;
+    case PKT_T_SRTLA_ACK: {
+      /* srtla_rec only sends an ACK after every RECV_ACK_INT packets, so the
+         older entries include the batching delay. The smallest sample is
+         the most accurate one */
+      conn_t *rtt_c = NULL;
+      int64_t min_rtt = -1;
       for (int i = 1; i < n/4; i++) {
-        uint32_t id = be32toh(acks[i]);
+        uint32_t id = pkt_be32(buf, i * 4);
         debug("%s (%p): ack %d\n", print_addr(&c->src), c, id);
-        register_srtla_ack(id);
+        int64_t rtt;
+        conn_t *ack_c = register_srtla_ack(c, id, ts_us, &rtt);
+        if (ack_c == c && (min_rtt < 0 || rtt < min_rtt)) {
+          rtt_c = ack_c;
+          min_rtt = rtt;
+        }
+      }
+      if (rtt_c) {
+        rtt_c->ack_rtt = min_rtt;
+        conn_update_rtt(rtt_c, min_rtt, ts_us);
       }
       return;
     }
-    case SRTLA_TYPE_KEEPALIVE:
+    case PKT_T_SRTLA_KEEPALIVE:
       debug("%s (%p): got a keepalive\n", print_addr(&c->src), c);
+      c->ka_rcvd++;
+      /* srtla_rec echoes keepalives back verbatim, including our timestamp */
+      if (n >= KEEPALIVE_TS_LEN) {
+        uint64_t sent_ts;
+        memcpy(&sent_ts, &buf[2], sizeof(sent_ts));
+        c->ka_rtt = ts_us - sent_ts;
+        conn_update_rtt(c, (int64_t)(ts_us - sent_ts), ts_us);
+
+        // Only probes sent after the link got suspended count towards re-enabling it
+        if (c->suspect && sent_ts >= c->suspect_since &&
+            ++c->readmit_probes >= READMIT_PROBES) {
+          info("%s (%p): responding again after %d ms, re-enabling the link\n",
+               print_addr(&c->src), c, (int)((ts_us - c->suspect_since) / 1000));
+          c->suspect = 0;
+        }
+      }
       return; // don't send to SRT
 
-    case SRTLA_TYPE_REG3:
+    case PKT_T_SRTLA_REG3:
       c->cstate = C_REGISTERED; // <<< FIJA EL ESTADO PARA EVITAR RE-REGISTROS
-      has_connected = 1;
-      active_connections++;
+      s->has_connected = 1;
+      s->active_connections++;
       info("%s (%p): connection established\n", print_addr(&c->src), c);
       return;
 
+    case PKT_T_SRT_DATA:
+    case PKT_T_SRT_CONTROL:
+      break;
+
+    default:
+      // Malformed packets and srtla packets we don't expect aren't for SRT
+      return;
   } // switch
 
-  sendto(listenfd, (const char*)buf, n, 0, &srt_addr, addr_len);
+  sendto(s->listenfd, (const char*)buf, n, 0, &s->srt_addr, addr_len);
 }
 
 
@@ -478,9 +2374,9 @@ void handle_srtla_data(conn_t *c) {
 Connection and socket management
 
 */
-conn_t *conn_find_by_src(struct sockaddr *src) {
+conn_t *conn_find_by_src(stream_t *s, struct sockaddr *src) {
   for (conn_t *c = conns; c != NULL; c = c->next) {
-    if (memcmp(src, &c->src, sizeof(*src)) == 0) {
+    if (c->stream == s && memcmp(src, &c->src, sizeof(*src)) == 0) {
       return c;
     }
   }
@@ -488,6 +2384,67 @@ conn_t *conn_find_by_src(struct sockaddr *src) {
   return NULL;
 }
 
+link_t *link_get(struct sockaddr *src) {
+  for (link_t *l = links; l != NULL; l = l->next) {
+    if (memcmp(src, &l->src, sizeof(*src)) == 0) {
+      return l;
+    }
+  }
+
+  link_t *l = calloc(1, sizeof(link_t));
+  assert(l != NULL);
+  l->src = *src;
+  l->next = links;
+  links = l;
+  return l;
+}
+
+void link_remove_conn(conn_t *c) {
+  link_t *l = c->link;
+  for (conn_t **i = &l->conns; *i != NULL; i = &(*i)->link_next) {
+    if (*i == c) {
+      *i = c->link_next;
+      break;
+    }
+  }
+
+  if (l->conns == NULL) {
+    for (link_t **i = &links; *i != NULL; i = &(*i)->next) {
+      if (*i == l) {
+        *i = l->next;
+        break;
+      }
+    }
+    free(l);
+  }
+}
+
+// Each stream gets its own conn over every source address
+int add_conns(struct sockaddr *src) {
+  int count = 0;
+  for (stream_t *s = streams; s != NULL; s = s->next) {
+    conn_t *c = conn_find_by_src(s, src);
+    if (c == NULL) {
+      c = calloc(1, sizeof(conn_t));
+      assert(c != NULL);
+      c->src = *src;
+      c->fd = -1;
+      c->window = WINDOW_DEF * WINDOW_MULT;
+      c->stream = s;
+      c->link = link_get(src);
+      c->link_next = c->link->conns;
+      c->link->conns = c;
+      c->next = conns;
+      conns = c;
+      count++;
+      printf("Added connection via %s (%p)\n", print_addr(&c->src), c);
+    } else {
+      c->removed = 0;
+    }
+  }
+  return count;
+}
+
 int setup_conns(char *source_ip_file) {
   FILE *config = fopen(source_ip_file, "r");
   if (config == NULL) {
@@ -511,20 +2468,7 @@ while(fgets(win_line, LINE_BUF_SZ, config)) {
     struct sockaddr src;
     int ret = parse_ip((struct sockaddr_in *)&src, line);
     if (ret == 0) {
-        conn_t *c = conn_find_by_src(&src);
-        if (c == NULL) {
-            conn_t *c = calloc(1, sizeof(conn_t));
-            assert(c != NULL);
-            c->src = src;
-            c->fd = -1;
-            c->window = WINDOW_DEF * WINDOW_MULT;
-            c->next = conns;
-            conns = c;
-            count++;
-            printf("Added connection via %s (%p)\n", print_addr(&c->src), c);
-        } else {
-            c->removed = 0;
-        }
+        count += add_conns(&src);
     }
 }
 #else
@@ -536,20 +2480,7 @@ while(getline(&line, &line_len, config) >= 0) {
     struct sockaddr src;
     int ret = parse_ip((struct sockaddr_in *)&src, line);
     if (ret == 0) {
-        conn_t *c = conn_find_by_src(&src);
-        if (c == NULL) {
-            conn_t *c = calloc(1, sizeof(conn_t));
-            assert(c != NULL);
-            c->src = src;
-            c->fd = -1;
-            c->window = WINDOW_DEF * WINDOW_MULT;
-            c->next = conns;
-            conns = c;
-            count++;
-            printf("Added connection via %s (%p)\n", print_addr(&c->src), c);
-        } else {
-            c->removed = 0;
-        }
+        count += add_conns(&src);
     }
 }
 if (line) free(line);
@@ -573,13 +2504,20 @@ void update_conns(char *source_ip_file) {
     if (c->removed) {
       printf("Removed connection via %s (%p)\n", print_addr(&c->src), c);
 
-      if (c == pending_reg2_conn) {
-        pending_reg2_conn = NULL;
+      if (c == c->stream->flowlet_conn) {
+        c->stream->flowlet_conn = NULL;
       }
+#ifdef HAVE_THREADS
+      // Drains the feedback of the link thread while c is still on its link
+      conn_stop_worker(c);
+#endif
+      link_remove_conn(c);
 
       remove_active_fd(c->fd);
       close(c->fd);
       *prev = c->next;
+      conn_pace_clear(c);
+      free(c->pace_q);
       free(c);
     } else {
       prev = &c->next;
@@ -587,12 +2525,45 @@ void update_conns(char *source_ip_file) {
   }
 }
 
+int conn_set_sndbuf(conn_t *c, int bufsize) {
+#ifdef _WIN32
+  int ret = setsockopt(c->fd, SOL_SOCKET, SO_SNDBUF, (const char*)&bufsize, sizeof(bufsize));
+#else
+  int ret = setsockopt(c->fd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+#endif
+  if (ret != 0) {
+    err("%s (%p): failed to set send buffer size (%d)\n",
+        print_addr(&c->src), c, bufsize);
+    return -1;
+  }
+  c->sndbuf = bufsize;
+  return 0;
+}
+
+/* Shrink the send buffer to a few BDPs of the link, so a stalled modem can't
+   absorb seconds worth of data before we notice. Only adjusted when the
+   target has moved by more than 25% to avoid needless syscalls */
+void conn_adapt_sndbuf(conn_t *c) {
+  if (c->fd < 0 || c->bw_est <= 0 || c->min_rtt <= 0) return;
+
+  int64_t bdp = c->bw_est * c->min_rtt / (1000 * 1000);
+  int target = min_max(bdp * SEND_BUF_BDP_MULT, SEND_BUF_MIN, SEND_BUF_SIZE);
+  if (target * 4 < c->sndbuf * 3 || target * 4 > c->sndbuf * 5) {
+    debug("%s (%p): resizing the send buffer from %d to %d bytes\n",
+          print_addr(&c->src), c, c->sndbuf, target);
+    conn_set_sndbuf(c, target);
+  }
+}
+
 void schedule_update_conns(int signal) {
   do_update_conns = 1;
 }
 
 int open_socket(conn_t *c, int quiet) {
   if (c->fd >= 0) {
+#ifdef HAVE_THREADS
+    conn_stop_worker(c);
+#endif
     remove_active_fd(c->fd);
     close(c->fd);
     c->fd = -1;
@@ -625,51 +2596,528 @@ int open_socket(conn_t *c, int quiet) {
     goto err;
   }
 
-  add_active_fd(fd);
   c->fd = fd;
+  c->sndbuf = bufsize;
+  c->outq_bytes = 0;
+
+#ifdef HAVE_THREADS
+  if (flag_threads) {
+    if (conn_start_worker(c) != 0) {
+      err("%s (%p): failed to start the link thread\n", print_addr(&c->src), c);
+      c->fd = -1;
+      goto err;
+    }
+    return 0;
+  }
+#endif
+  add_active_fd(fd);
+
+  return 0;
+
+err:
+  close(fd);
+  return -1;
+}
+
+int open_conns() {
+  // Check that we can actually open & bind at least one socket
+  int opened = 0;
+  for (conn_t *c = conns; c != NULL; c = c->next) {
+    if (open_socket(c, 0) == 0) {
+      opened++;
+    }
+  }
+  return opened;
+}
+
+/*
+
+Connection housekeeping
+
+*/
+void set_srtla_addr(stream_t *s, struct addrinfo *addr) {
+  memcpy(&s->srtla_addr, addr->ai_addr, addr->ai_addrlen);
+  info("Trying to connect to %s...\n", print_addr(&s->srtla_addr));
+}
+
+/* Forget everything we know about a failed link, it starts over from the
+   initial window once it's re-registered */
+void conn_reset(conn_t *c) {
+  c->last_rcvd = 0;
+  c->last_sent = 0;
+  c->window = WINDOW_MIN * WINDOW_MULT;
+  c->in_flight_pkts = 0;
+  c->in_flight_bytes = 0;
+  for (int i = 0; i < PKT_LOG_SZ; i++) {
+    c->pkt_log[i] = -1;
+  }
+  conn_reset_rtt(c);
+  conn_reset_rate(c);
+  conn_pace_clear(c);
+  if (c == c->stream->flowlet_conn) {
+    c->stream->flowlet_conn = NULL;
+  }
+  c->suspect = 0;
+  c->probing = 0;
+  // start reconnection/reg retry state
+  c->reg_attempts = 0;
+  c->backoff_ms = REG_RETRY_BASE_MS;
+  c->cstate = C_CONNECTING;
+  uint64_t now = 0; get_ms(&now);
+  c->next_reg_try_ms = now; // immediate
+}
+
+/* The keepalive carries our send timestamp, which is opaque to the receiver
+   and only needs to survive the echo, so it's kept in host byte order */
+void send_keepalive(conn_t *c) {
+  debug("%s (%p): sending keepalive\n", print_addr(&c->src), c);
+  char pkt[KEEPALIVE_TS_LEN];
+  uint16_t type = htobe16(SRTLA_TYPE_KEEPALIVE);
+  uint64_t ts;
+  get_us(&ts);
+  memcpy(pkt, &type, sizeof(type));
+  memcpy(&pkt[2], &ts, sizeof(ts));
+  conn_sendto(c, pkt, sizeof(pkt)); // ignoring the result on purpose
+  c->ka_sent++;
+}
+
+/*
+  Per-link failure detection, run from the main loop
+
+  A link that carries data hears from the receiver all the time: SRTLA
+  ACKs, plus the SRT ACKs srtla_rec broadcasts over all links. Once a link
+  has been silent for one keepalive interval (half its RTO) we start
+  probing it with keepalives, and after SUSPECT_MISSES unanswered ones it's
+  suspended: the schedulers skip it, but it keeps being probed and is
+  re-enabled after READMIT_PROBES answers. This takes a few hundred ms,
+  rather than the CONN_TIMEOUT seconds after which the link is considered
+  failed and re-registered by connection_housekeeping()
+*/
+int64_t conn_rto(conn_t *c) {
+  if (c->srtt == 0) return RTO_MAX;
+  return min_max(c->srtt + 4 * c->rttvar, RTO_MIN, RTO_MAX);
+}
+
+int64_t conn_ka_int(conn_t *c) {
+  return max(conn_rto(c) / 2, KA_INT_MIN);
+}
+
+// Returns the time until the link's next keepalive is due, in us
+uint64_t conn_liveness_tick(conn_t *c, uint64_t ts) {
+  if (c->fd < 0 || c->link_down || c->last_rcvd == 0 || c->last_rcvd_us == 0) {
+    return RTO_MAX;
+  }
+
+  int64_t ka_int = conn_ka_int(c);
+  uint64_t last_heard = c->last_rcvd_us;
+  if (ts < last_heard || ts < c->last_ka_us) return ka_int;
+
+  // Suspended links are probed on a fixed schedule, whatever else they receive
+  uint64_t last_probe = c->suspect ? c->last_ka_us : max(last_heard, c->last_ka_us);
+  if (ts - last_probe >= (uint64_t)ka_int) {
+    send_keepalive(c);
+    c->last_ka_us = ts;
+    last_probe = ts;
+  }
+
+  uint64_t silence = ts - last_heard;
+  if (!c->suspect && silence > (uint64_t)(SUSPECT_MISSES * ka_int + conn_rto(c))) {
+    info("%s (%p): no response for %d ms, suspending the link\n",
+         print_addr(&c->src), c, (int)(silence / 1000));
+    c->suspect = 1;
+    c->readmit_probes = 0;
+    c->suspect_since = ts;
+    c->detect_cnt++;
+    c->detect_sum += silence;
+    c->detect_max = max(c->detect_max, silence);
+    if (c == c->stream->flowlet_conn) {
+      c->stream->flowlet_conn = NULL;
+    }
+  }
+
+  return last_probe + ka_int - ts;
+}
+
+uint64_t liveness_tick(uint64_t ts) {
+  uint64_t wait = RTO_MAX;
+  for (conn_t *c = conns; c != NULL; c = c->next) {
+    wait = min(wait, conn_liveness_tick(c, ts));
+  }
+  return wait;
+}
+
+/*
+  Encoder feedback
+
+  With --feedback-sock PATH, a JSON object is sent to the UNIX datagram
+  socket at PATH every FEEDBACK_INT, for the encoder's bitrate control:
+
+  {"bitrate_kbps":N,"capacity_kbps":N,"trend":"down|hold|up",
+   "links":[{"addr":"...","state":"active|suspended|down","capacity_kbps":N,
+             "bw_kbps":N,"srtt_ms":N,"rttvar_ms":N,"loss_permille":N,
+             "in_flight_bytes":N,"congested":0|1}, ...],
+   "streams":[{"port":N,"weight":N,"bitrate_kbps":N}, ...]}
+
+  A link's capacity is the larger of its measured delivery rate and the
+  rate its window allows, reduced by its loss rate, and by a quarter when
+  its RTT shows a standing queue. bitrate_kbps is FEEDBACK_HEADROOM percent
+  of the total. It follows decreases right away, so that the encoder can
+  back off before the queues turn into NAKs, but only rises after the
+  capacity has stayed higher for FEEDBACK_UP_HOLD, and then in steps.
+  Each stream's recommendation is its weight's share of bitrate_kbps. The
+  streams sharing a link each have their own view of it, and the conn with
+  the largest capacity is reported
+*/
+#ifndef _WIN32
+int feedback_fd = -1;
+struct sockaddr_un feedback_addr;
+int64_t feedback_bitrate = 0; // bytes/s
+uint64_t feedback_up_since = 0;
+
+int feedback_init(char *path) {
+  if (strlen(path) >= sizeof(feedback_addr.sun_path)) return -1;
+
+  // SOCK_NONBLOCK and SOCK_CLOEXEC are Linux only
+  feedback_fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+  if (feedback_fd < 0) return -1;
+  fcntl(feedback_fd, F_SETFL, O_NONBLOCK);
+  fcntl(feedback_fd, F_SETFD, FD_CLOEXEC);
+
+  memset(&feedback_addr, 0, sizeof(feedback_addr));
+  feedback_addr.sun_family = AF_UNIX;
+  strcpy(feedback_addr.sun_path, path);
+  return 0;
+}
+
+int conn_congested(conn_t *c) {
+  return c->srtt > 0 && c->min_rtt > 0 &&
+         (c->srtt - c->min_rtt) > max(c->min_rtt, FEEDBACK_QDELAY_MAX);
+}
+
+int64_t conn_capacity(conn_t *c) {
+  int64_t capacity = max(c->bw_est, conn_window_rate(c));
+  capacity = capacity * (1000 - c->loss_rate) / 1000;
+  if (conn_congested(c)) {
+    capacity = capacity * 3 / 4;
+  }
+  return capacity;
+}
+
+void feedback_tick(uint64_t ts) {
+  static uint64_t last_sent = 0;
+  if (feedback_fd < 0 || ts < last_sent + FEEDBACK_INT) return;
+  last_sent = ts;
+
+  time_t t;
+  get_seconds(&t);
+
+  char link_info[FEEDBACK_MSG_SZ];
+  int link_info_len = 0;
+  int64_t capacity = 0;
+  for (link_t *l = links; l != NULL; l = l->next) {
+    conn_t *c = l->conns;
+    int64_t link_capacity = 0;
+    for (conn_t *i = l->conns; i != NULL; i = i->link_next) {
+      if (conn_timed_out(i, t) || i->suspect) continue;
+      int64_t cap = conn_capacity(i);
+      if (link_capacity == 0 || cap > link_capacity) {
+        c = i;
+        link_capacity = cap;
+      }
+    }
+
+    const char *state = "active";
+    if (conn_timed_out(c, t)) {
+      state = "down";
+    } else if (c->suspect) {
+      state = "suspended";
+    } else {
+      capacity += link_capacity;
+    }
+
+    int ret = snprintf(link_info + link_info_len, sizeof(link_info) - link_info_len,
+                       "%s{\"addr\":\"%s\",\"state\":\"%s\",\"capacity_kbps\":%lld,"
+                       "\"bw_kbps\":%lld,\"srtt_ms\":%d,\"rttvar_ms\":%d,"
+                       "\"loss_permille\":%d,\"in_flight_bytes\":%d,\"congested\":%d}",
+                       link_info_len ? "," : "", print_addr(&c->src), state,
+                       (long long)(link_capacity * 8 / 1000), (long long)(c->bw_est * 8 / 1000),
+                       c->srtt / 1000, c->rttvar / 1000, c->loss_rate,
+                       c->in_flight_bytes, conn_congested(c));
+    if (ret < 0 || ret >= (int)sizeof(link_info) - link_info_len) break;
+    link_info_len += ret;
+  }
+  link_info[link_info_len] = '\0';
+
+  int64_t target = capacity * FEEDBACK_HEADROOM / 100;
+  const char *trend = "hold";
+  if (target * 100 < feedback_bitrate * (100 - FEEDBACK_DOWN_HYST)) {
+    feedback_bitrate = target;
+    feedback_up_since = 0;
+    trend = "down";
+  } else if (target > feedback_bitrate) {
+    if (feedback_up_since == 0) {
+      feedback_up_since = ts;
+    }
+    if (feedback_bitrate == 0 || ts - feedback_up_since >= FEEDBACK_UP_HOLD) {
+      int64_t step = max(feedback_bitrate * FEEDBACK_UP_STEP / 100, 1);
+      feedback_bitrate = feedback_bitrate ? min(target, feedback_bitrate + step) : target;
+      trend = "up";
+    }
+  } else {
+    feedback_up_since = 0;
+  }
+
+  int weights = 0;
+  for (stream_t *s = streams; s != NULL; s = s->next) {
+    weights += s->weight;
+  }
+  char stream_info[FEEDBACK_MSG_SZ / 4];
+  int stream_info_len = 0;
+  for (stream_t *s = streams; s != NULL; s = s->next) {
+    int ret = snprintf(stream_info + stream_info_len, sizeof(stream_info) - stream_info_len,
+                       "%s{\"port\":%d,\"weight\":%d,\"bitrate_kbps\":%lld}",
+                       stream_info_len ? "," : "", s->listen_port, s->weight,
+                       (long long)(feedback_bitrate * s->weight / weights * 8 / 1000));
+    if (ret < 0 || ret >= (int)sizeof(stream_info) - stream_info_len) break;
+    stream_info_len += ret;
+  }
+  stream_info[stream_info_len] = '\0';
+
+  char msg[FEEDBACK_MSG_SZ + sizeof(stream_info) + 128];
+  int len = snprintf(msg, sizeof(msg),
+                     "{\"bitrate_kbps\":%lld,\"capacity_kbps\":%lld,\"trend\":\"%s\","
+                     "\"links\":[%s],\"streams\":[%s]}",
+                     (long long)(feedback_bitrate * 8 / 1000), (long long)(capacity * 8 / 1000),
+                     trend, link_info, stream_info);
+  // Nobody may be listening yet, that's fine
+  sendto(feedback_fd, msg, min(len, (int)sizeof(msg) - 1), 0,
+         (struct sockaddr *)&feedback_addr, sizeof(feedback_addr));
+}
+#endif
+
+/*
+  Metrics endpoint
+
+  With --metrics PATH|[IP:]PORT, the state of the conns and the counters
+  below are served in the Prometheus text format, see metrics_serve(). Each
+  counter only has a single writer: the main thread for the conn_t and
+  global ones, a link thread for its link_worker_t ones. They're plain
+  increments on the packet paths, and only summed up here when scraped
+*/
+int metrics_sock = -1;
+uint64_t loop_iters = 0;
+uint64_t loop_wakeups = 0; // select() calls that returned ready sockets
+
+typedef enum {
+  CM_UP = 0,
+  CM_SENT_PKTS,
+  CM_SENT_BYTES,
+  CM_RCVD_PKTS,
+  CM_RCVD_BYTES,
+  CM_SEND_ERRORS,
+  CM_TX_DROPS,
+  CM_NAKS,
+  CM_DUP_ACKS,
+  CM_KA_SENT,
+  CM_KA_RCVD,
+  CM_PACE_OVERFLOWS,
+  CM_RX_DROPS,
+  CM_WINDOW,
+  CM_IN_FLIGHT_PKTS,
+  CM_IN_FLIGHT_BYTES,
+  CM_ACK_RTT,
+  CM_KA_RTT,
+  CM_SRTT,
+  CM_BW,
+  CM_LOSS,
+  CM_CNT
+} conn_metric_t;
+
+const metric_desc_t conn_metrics[CM_CNT] = {
+  [CM_UP] = {"srtla_send_conn_up", "gauge",
+    "Whether the connection is registered and responding"},
+  [CM_SENT_PKTS] = {"srtla_send_conn_sent_packets_total", "counter",
+    "SRT, probe and parity packets sent over the connection"},
+  [CM_SENT_BYTES] = {"srtla_send_conn_sent_bytes_total", "counter",
+    "Bytes of the packets sent over the connection"},
+  [CM_RCVD_PKTS] = {"srtla_send_conn_received_packets_total", "counter",
+    "Packets received from srtla_rec over the connection"},
+  [CM_RCVD_BYTES] = {"srtla_send_conn_received_bytes_total", "counter",
+    "Bytes of the packets received over the connection"},
+  [CM_SEND_ERRORS] = {"srtla_send_conn_send_errors_total", "counter",
+    "Failed sends, each of which disables the connection"},
+  [CM_TX_DROPS] = {"srtla_send_conn_tx_drops_total", "counter",
+    "Packets dropped because the link thread's transmit queue was full"},
+  [CM_NAKS] = {"srtla_send_conn_naks_total", "counter",
+    "Packets sent over the connection that SRT reported lost"},
+  [CM_DUP_ACKS] = {"srtla_send_conn_duplicate_acks_total", "counter",
+    "SRT ACK copies received over the connection and dropped"},
+  [CM_KA_SENT] = {"srtla_send_conn_keepalives_sent_total", "counter",
+    "Keepalives sent over the connection"},
+  [CM_KA_RCVD] = {"srtla_send_conn_keepalives_received_total", "counter",
+    "Keepalives echoed back by srtla_rec"},
+  [CM_PACE_OVERFLOWS] = {"srtla_send_conn_pacing_overflows_total", "counter",
+    "Packets sent without pacing because the pacing queue was full"},
+  [CM_RX_DROPS] = {"srtla_send_conn_rx_drops_total", "counter",
+    "Received packets dropped because the link thread queue was full"},
+  [CM_WINDOW] = {"srtla_send_conn_window_packets", "gauge",
+    "Congestion window"},
+  [CM_IN_FLIGHT_PKTS] = {"srtla_send_conn_in_flight_packets", "gauge",
+    "Packets sent and not acknowledged yet"},
+  [CM_IN_FLIGHT_BYTES] = {"srtla_send_conn_in_flight_bytes", "gauge",
+    "Bytes sent and not acknowledged yet"},
+  [CM_ACK_RTT] = {"srtla_send_conn_ack_latency_seconds", "gauge",
+    "Last round trip time measured with an SRTLA ACK"},
+  [CM_KA_RTT] = {"srtla_send_conn_keepalive_rtt_seconds", "gauge",
+    "Last round trip time measured with a keepalive"},
+  [CM_SRTT] = {"srtla_send_conn_srtt_seconds", "gauge",
+    "Smoothed round trip time"},
+  [CM_BW] = {"srtla_send_conn_delivery_rate_bytes", "gauge",
+    "Measured delivery rate, in bytes per second"},
+  [CM_LOSS] = {"srtla_send_conn_loss_ratio", "gauge",
+    "Estimated packet loss rate"},
+};
+
+double conn_metric(conn_t *c, conn_metric_t metric, time_t t) {
+  switch (metric) {
+    case CM_UP:
+      return c->cstate == C_REGISTERED && !conn_timed_out(c, t) && !c->suspect;
+    case CM_SENT_PKTS: return c->sent_pkts;
+    case CM_SENT_BYTES: return c->sent_bytes;
+    case CM_RCVD_PKTS: return c->rcvd_pkts;
+    case CM_RCVD_BYTES: return c->rcvd_bytes;
+    case CM_SEND_ERRORS: return c->send_errors;
+    case CM_TX_DROPS: return c->tx_drops;
+    case CM_NAKS: return c->naks;
+    case CM_DUP_ACKS: return c->dup_acks;
+    case CM_KA_SENT: return c->ka_sent;
+    case CM_KA_RCVD: return c->ka_rcvd;
+    case CM_PACE_OVERFLOWS: return c->pace_overflows;
+    case CM_RX_DROPS:
+#ifdef HAVE_THREADS
+      if (c->worker) {
+        return atomic_load_explicit(&c->worker->rx_drops, memory_order_relaxed);
+      }
+#endif
+      return 0;
+    case CM_WINDOW: return (double)c->window / WINDOW_MULT;
+    case CM_IN_FLIGHT_PKTS: return c->in_flight_pkts;
+    case CM_IN_FLIGHT_BYTES: return c->in_flight_bytes;
+    case CM_ACK_RTT: return c->ack_rtt / 1e6;
+    case CM_KA_RTT: return c->ka_rtt / 1e6;
+    case CM_SRTT: return c->srtt / 1e6;
+    case CM_BW: return c->bw_est;
+    case CM_LOSS: return c->loss_rate / 1000.0;
+    default: return 0;
+  }
+}
 
-  return 0;
+void metrics_fill(metrics_buf_t *m) {
+  time_t t;
+  get_seconds(&t);
 
-err:
-  close(fd);
-  return -1;
-}
+  for (int i = 0; i < CM_CNT; i++) {
+    metrics_family(m, &conn_metrics[i]);
+    for (conn_t *c = conns; c != NULL; c = c->next) {
+      metrics_printf(m, "%s{link=\"%s\",stream=\"%d\"} %.15g\n", conn_metrics[i].name,
+                     print_addr(&c->src), c->stream->listen_port, conn_metric(c, i, t));
+    }
+  }
 
-int open_conns(char *host, char *port) {
-  // Check that we can actually open & bind at least one socket
-  int opened = 0;
-  for (conn_t *c = conns; c != NULL; c = c->next) {
-    if (open_socket(c, 0) == 0) {
-      opened++;
+  // Per stream totals over its conns
+  static const metric_desc_t stream_metrics[] = {
+    {"srtla_send_stream_active_connections", "gauge", "Registered connections"},
+    {"srtla_send_stream_sent_packets_total", "counter", "Packets sent over all the connections"},
+    {"srtla_send_stream_sent_bytes_total", "counter", "Bytes sent over all the connections"},
+    {"srtla_send_stream_naks_total", "counter", "Packets reported lost by SRT"},
+  };
+  for (int i = 0; i < (int)(sizeof(stream_metrics) / sizeof(stream_metrics[0])); i++) {
+    metrics_family(m, &stream_metrics[i]);
+    for (stream_t *s = streams; s != NULL; s = s->next) {
+      uint64_t total = 0;
+      if (i == 0) {
+        total = s->active_connections;
+      } else {
+        for (conn_t *c = conns; c != NULL; c = c->next) {
+          if (c->stream != s) continue;
+          total += (i == 1) ? c->sent_pkts : (i == 2) ? c->sent_bytes : c->naks;
+        }
+      }
+      metrics_printf(m, "%s{stream=\"%d\"} %llu\n", stream_metrics[i].name,
+                     s->listen_port, (unsigned long long)total);
     }
   }
-  return opened;
+
+  metric_desc_t desc = {"srtla_send_srt_packets_total", "counter",
+                        "Packets received from the SRT callers"};
+  metrics_family(m, &desc);
+  for (int i = 0; i < PKT_CLASS_CNT; i++) {
+    metrics_printf(m, "%s{class=\"%s\"} %d\n", desc.name, pkt_class_names[i], pkt_class_cnt[i]);
+  }
+  desc = (metric_desc_t){"srtla_send_stale_drops_total", "counter",
+                         "Packets dropped for exceeding the latency budget"};
+  metrics_family(m, &desc);
+  for (int i = 0; i < PKT_CLASS_CNT; i++) {
+    metrics_printf(m, "%s{class=\"%s\"} %d\n", desc.name, pkt_class_names[i], stale_drops[i]);
+  }
+  metrics_single(m, "srtla_send_stale_rescued_total", "counter",
+                 "Packets sent over another link rather than dropped as stale",
+                 stale_rescued);
+  metrics_single(m, "srtla_send_fec_parity_packets_total", "counter",
+                 "FEC parity packets sent", fec_parity_sent);
+  metrics_single(m, "srtla_send_probe_bytes_total", "counter",
+                 "Bytes of the capacity probing packets", probe_bytes);
+
+  metrics_single(m, "srtla_send_loop_iterations_total", "counter",
+                 "Event loop iterations", loop_iters);
+  metrics_single(m, "srtla_send_loop_wakeups_total", "counter",
+                 "Event loop iterations with sockets ready", loop_wakeups);
+  pkt_pool_stats_t pool;
+  pkt_pool_get_stats(&pool);
+  metrics_single(m, "srtla_send_packet_buffers", "gauge",
+                 "Buffers in the packet pool", pool.total);
+  metrics_single(m, "srtla_send_packet_buffers_in_use", "gauge",
+                 "Packet buffers in use", pool.in_use);
+  metrics_single(m, "srtla_send_packet_buffer_mallocs_total", "counter",
+                 "Memory allocations by the packet pool", pool.mallocs);
+  uint64_t ms;
+  get_ms(&ms);
+  metrics_single(m, "srtla_send_uptime_seconds", "gauge",
+                 "Time since srtla_send started", (ms - startup_ms) / 1000.0);
 }
 
-/*
+#define HOUSEKEEPING_INT 1000 // ms
+/* Gives up on a stream once all its links have failed for GLOBAL_TIMEOUT.
+   All the addresses of the receiver are tried at once by stream_join() */
+void stream_housekeeping(stream_t *s, uint64_t ms) {
+  if (s->active_connections > 0) {
+    s->all_failed_at = 0;
+    return;
+  }
 
-Connection housekeeping
+  if (s->all_failed_at == 0) {
+    s->all_failed_at = ms;
+  }
 
-*/
-void set_srtla_addr(struct addrinfo *addr) {
-  memcpy(&srtla_addr, addr->ai_addr, addr->ai_addrlen);
-  info("Trying to connect to %s...\n", print_addr(&srtla_addr));
-}
+  if (s->has_connected) {
+    err("warning: no available connections\n");
+  }
 
-void send_keepalive(conn_t *c) {
-  debug("%s (%p): sending keepalive\n", print_addr(&c->src), c);
-  uint16_t pkt = htobe16(SRTLA_TYPE_KEEPALIVE);
-#ifdef _WIN32
-    int ret = sendto(c->fd, (const char*)&pkt, sizeof(pkt), 0, (struct sockaddr*)&srtla_addr, addr_len);
-#else
-    int ret = sendto(c->fd, &pkt, sizeof(pkt), 0, &srtla_addr, addr_len);
-#endif
-  // ignoring the result on purpose
+  // Timeout when all connections have failed
+  if (s->gave_up || ms <= (s->all_failed_at + (GLOBAL_TIMEOUT * 1000))) return;
+
+  if (s->has_connected) {
+    err("Failed to re-establish any connections to %s\n",
+        print_addr(&s->srtla_addr));
+    s->gave_up = 1;
+    return;
+  }
+
+  err("Failed to establish any initial connections to %s\n", s->srtla_host);
+  s->gave_up = 1;
 }
 
-#define HOUSEKEEPING_INT 1000 // ms
 void connection_housekeeping() {
-  static uint64_t all_failed_at = 0;
   /* We use milliseconds here because with a seconds timer we may be
      resending a second REG2 very soon after the first one, depending
      on when the first execution happens within the seconds interval */
@@ -680,13 +3128,29 @@ void connection_housekeeping() {
 
   time_t time = (time_t)(ms / 1000);
 
-  active_connections = 0;
+  for (stream_t *s = streams; s != NULL; s = s->next) {
+    s->active_connections = 0;
 
-  if (pending_reg2_conn && time > pending_reg_timeout) {
-    pending_reg2_conn = NULL;
+    if (s->reg_pending && time > s->pending_reg_timeout) {
+      s->reg_pending = 0;
+
+      if (s->reg_caps_offered && ++s->reg_caps_timeouts >= FEC_REG_FALLBACK) {
+        info("No reply to the extended REG1, retrying without capabilities\n");
+        s->reg_caps_offered = 0;
+      }
+    }
+
+    if (!s->has_group && !s->reg_pending) {
+      stream_join(s, time);
+    }
   }
 
   for (conn_t *c = conns; c != NULL; c = c->next) {
+    stream_t *s = c->stream;
+
+    // Links without an interface are brought back by nl_handle()
+    if (c->link_down) continue;
+
     if (c->fd < 0) {
       open_socket(c, 1);
       continue;
@@ -698,27 +3162,13 @@ void connection_housekeeping() {
       if (c->last_rcvd > 0) {
         info("%s (%p): connection failed, attempting to reconnect\n",
              print_addr(&c->src), c);
-        c->last_rcvd = 0;
-        c->last_sent = 0;
-        c->window = WINDOW_MIN * WINDOW_MULT;
-        c->in_flight_pkts = 0;
-        for (int i = 0; i < PKT_LOG_SZ; i++) {
-          c->pkt_log[i] = -1;
-        }
-        // start reconnection/reg retry state
-        c->reg_attempts = 0;
-        c->backoff_ms = REG_RETRY_BASE_MS;
-        c->cstate = C_CONNECTING;
-        uint64_t now = 0; get_ms(&now);
-        c->next_reg_try_ms = now; // immediate
+        conn_reset(c);
       }
 
-      if (pending_reg2_conn == NULL) {
+      if (s->has_group && !s->reg_pending) {
         /* As the connection has timed out on our end, the receiver might have garbage
            collected it. Try to re-establish it rather than send a keepalive */
         send_reg2(c);
-      } else if (pending_reg2_conn == c) {
-        send_reg1(c);
       }
       continue;
     }
@@ -730,11 +3180,11 @@ void connection_housekeeping() {
         err("%s (%p): registration attempts exceeded\n", print_addr(&c->src), c);
         c->cstate = C_DEAD;
       } else {
-        // attempt a REG1/REG2 depending on pending state
-        if (pending_reg2_conn == NULL) {
-          send_reg1(c);
-        } else {
+        // join the group, or the whole stream if it doesn't have one yet
+        if (s->has_group) {
           send_reg2(c);
+        } else if (!s->reg_pending) {
+          stream_join(s, time);
         }
         c->reg_attempts++;
         c->backoff_ms = min(c->backoff_ms * 2, REG_RETRY_MAX_MS);
@@ -744,53 +3194,297 @@ void connection_housekeeping() {
 
     /* If a connection has received data in the last CONN_TIMEOUT seconds,
        then it's active */
-    active_connections++;
+    s->active_connections++;
+
+    if (flag_adaptive_sndbuf) {
+      conn_adapt_sndbuf(c);
+    }
+
+    if (c->loss_sent > 0) {
+      int loss = min(c->loss_naks * 1000 / c->loss_sent, 1000);
+      c->loss_rate = (7 * c->loss_rate + loss) / 8;
+      c->loss_sent = 0;
+      c->loss_naks = 0;
+    }
 
     if ((c->last_sent + IDLE_TIME) < time) {
       send_keepalive(c);
     }
   }
 
-  if (active_connections == 0) {
-    if (all_failed_at == 0) {
-      all_failed_at = ms;
-    }
+  // Only exit once every stream has given up
+  int gave_up = 1;
+  for (stream_t *s = streams; s != NULL; s = s->next) {
+    stream_housekeeping(s, ms);
+    gave_up = gave_up && s->gave_up;
+  }
+  if (gave_up) {
+    exit(EXIT_FAILURE);
+  }
 
-    if (has_connected) {
-      err("warning: no available connections\n");
-    }
+  last_ran = ms;
+}
+
+#define ARG_LISTEN_PORT (argv[1])
+#define ARG_SRTLA_HOST  (argv[2])
+#define ARG_SRTLA_PORT  (argv[3])
+#define ARG_IPS_FILE    (argv[4])
+/*
+
+Link state monitoring
+
+Without help, a link whose modem was unplugged or lost its address is only
+detected by conn_timed_out(), after CONN_TIMEOUT seconds of sending into the
+void. On Linux we subscribe to rtnetlink address and link events instead:
+the links are disabled as soon as their source address is removed or their
+interface loses carrier, and are reopened and re-registered as soon as it
+comes back. An address dump at startup and after update_conns() maps each
+link to its interface.
+
+*/
+#ifdef __linux__
+int nl_fd = -1;
+
+int nl_request_addrs() {
+  struct {
+    struct nlmsghdr nh;
+    struct ifaddrmsg ifa;
+  } req;
+  memset(&req, 0, sizeof(req));
+  req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(req.ifa));
+  req.nh.nlmsg_type = RTM_GETADDR;
+  req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+  req.ifa.ifa_family = AF_INET;
+
+  int ret = send(nl_fd, &req, req.nh.nlmsg_len, 0);
+  return (ret == (int)req.nh.nlmsg_len) ? 0 : -1;
+}
+
+int nl_init() {
+  nl_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+  if (nl_fd < 0) return -1;
+
+  struct sockaddr_nl sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.nl_family = AF_NETLINK;
+  sa.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR;
+  if (bind(nl_fd, (struct sockaddr *)&sa, sizeof(sa)) != 0 ||
+      nl_request_addrs() != 0) {
+    close(nl_fd);
+    nl_fd = -1;
+    return -1;
+  }
+
+  add_active_fd(nl_fd);
+  return 0;
+}
+
+void conn_update_link_state(conn_t *c) {
+  int down = c->addr_gone || c->carrier_down;
+  if (down == c->link_down) return;
+
+  if (down) {
+    info("%s (%p): %s, disabling the link\n", print_addr(&c->src), c,
+         c->addr_gone ? "source address removed" : "interface down");
+    c->link_down = 1;
+    conn_reset(c);
+    return;
+  }
+
+  info("%s (%p): link is back, reconnecting\n", print_addr(&c->src), c);
+  c->link_down = 0;
+  // The old socket may be bound to an address that went away and came back
+  if (open_socket(c, 0) != 0) return;
+  if (c->stream->has_group && !c->stream->reg_pending) {
+    send_reg2(c);
+  }
+}
+
+void nl_handle_addr(struct nlmsghdr *nh) {
+  struct ifaddrmsg *ifa = NLMSG_DATA(nh);
+  if (ifa->ifa_family != AF_INET) return;
+
+  struct in_addr *local = NULL, *address = NULL;
+  int len = IFA_PAYLOAD(nh);
+  for (struct rtattr *rta = IFA_RTA(ifa); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+    if (rta->rta_type == IFA_LOCAL) local = RTA_DATA(rta);
+    if (rta->rta_type == IFA_ADDRESS) address = RTA_DATA(rta);
+  }
+  // IFA_LOCAL is our address on point-to-point interfaces, IFA_ADDRESS the peer's
+  if (local == NULL) local = address;
+  if (local == NULL) return;
+
+  for (conn_t *c = conns; c != NULL; c = c->next) {
+    struct sockaddr_in *src = (struct sockaddr_in *)&c->src;
+    if (src->sin_addr.s_addr != local->s_addr) continue;
 
-    // Timeout when all connections have failed
-    if (ms > (all_failed_at + (GLOBAL_TIMEOUT * 1000))) {
-      if (has_connected) {
-        err("Failed to re-establish any connections to %s\n",
-            print_addr(&srtla_addr));
-        exit(EXIT_FAILURE);
+    if (nh->nlmsg_type == RTM_NEWADDR) {
+      if (c->ifindex != (int)ifa->ifa_index) {
+        c->ifindex = ifa->ifa_index;
+        c->carrier_down = 0;
       }
+      c->addr_gone = 0;
+    } else {
+      c->addr_gone = 1;
+    }
+    conn_update_link_state(c);
+  }
+}
 
-      err("Failed to establish any initial connections to %s\n",
-          print_addr(&srtla_addr));
+void nl_handle_link(struct nlmsghdr *nh) {
+  struct ifinfomsg *ifi = NLMSG_DATA(nh);
+  int running = nh->nlmsg_type == RTM_NEWLINK &&
+                (ifi->ifi_flags & IFF_UP) && (ifi->ifi_flags & IFF_RUNNING);
 
-      // Walk through the list of resolved addresses
-      if (addrs->ai_next) {
-        addrs = addrs->ai_next;
-        set_srtla_addr(addrs);
-        all_failed_at = 0;
-      } else {
-        exit(EXIT_FAILURE);
+  for (conn_t *c = conns; c != NULL; c = c->next) {
+    if (c->ifindex == 0 || c->ifindex != ifi->ifi_index) continue;
+    c->carrier_down = !running;
+    conn_update_link_state(c);
+  }
+}
+
+void nl_handle() {
+  char buf[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+
+  while (1) {
+    int n = recv(nl_fd, buf, sizeof(buf), 0);
+    if (n < 0) {
+      // We missed some events, so ask for the current state again
+      if (errno == ENOBUFS) {
+        nl_request_addrs();
+        continue;
+      }
+      return;
+    }
+
+    for (struct nlmsghdr *nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, n); nh = NLMSG_NEXT(nh, n)) {
+      switch (nh->nlmsg_type) {
+        case RTM_NEWADDR:
+        case RTM_DELADDR:
+          nl_handle_addr(nh);
+          break;
+        case RTM_NEWLINK:
+        case RTM_DELLINK:
+          nl_handle_link(nh);
+          break;
       }
     }
-  } else {
-    all_failed_at = 0;
   }
+}
+#endif
 
-  last_ran = ms;
+/*
+
+Streams
+
+A single srtla_send can carry several SRT streams over the same links, e.g.
+one per camera. Each stream has its own SRT listen port, receiver and SRTLA
+connection group. srtla_rec maps a source address and port to a single
+group, so each stream still needs its own socket on every link, but the
+conns of the streams sharing a source address form a link_t, and the
+schedulers account for the link-wide in-flight data, socket queues and
+bandwidth. While a link is saturated, each stream is limited to its weight's
+share of it, see conn_over_share(). The positional arguments define the
+first stream, --stream adds more
+
+*/
+stream_t *stream_add(char *listen_port, char *srtla_host, char *srtla_port, int weight) {
+  int port = parse_port(listen_port);
+  if (port < 0 || parse_port(srtla_port) < 0) return NULL;
+
+  stream_t *s = calloc(1, sizeof(stream_t));
+  assert(s != NULL);
+  s->listen_port = port;
+  s->srtla_host = srtla_host;
+  s->srtla_port = srtla_port;
+  s->weight = max(weight, 1);
+  s->listenfd = -1;
+
+  // Keep them in the order they were given
+  stream_t **next = &streams;
+  while (*next) next = &(*next)->next;
+  *next = s;
+
+  return s;
+}
+
+// Parses LISTEN_PORT,SRTLA_HOST,SRTLA_PORT[,WEIGHT]
+stream_t *stream_add_spec(char *spec) {
+  char *listen_port = strtok(spec, ",");
+  char *srtla_host = strtok(NULL, ",");
+  char *srtla_port = strtok(NULL, ",");
+  char *weight = strtok(NULL, ",");
+  if (listen_port == NULL || srtla_host == NULL || srtla_port == NULL) return NULL;
+
+  return stream_add(listen_port, srtla_host, srtla_port, weight ? atoi(weight) : 1);
+}
+
+// Read a random connection group id for this session
+void stream_gen_id(stream_t *s) {
+#ifdef _WIN32
+  // Windows'ta /dev/urandom yok, bunun yerine CryptGenRandom kullanabiliriz
+  HCRYPTPROV hCryptProv;
+  if (!CryptAcquireContext(&hCryptProv, NULL, NULL, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT)) {
+    fprintf(stderr, "CryptAcquireContext failed: %lu\n", GetLastError());
+    exit(EXIT_FAILURE);
+  }
+  if (!CryptGenRandom(hCryptProv, SRTLA_ID_LEN, (BYTE*)s->srtla_id)) {
+    fprintf(stderr, "CryptGenRandom failed: %lu\n", GetLastError());
+    CryptReleaseContext(hCryptProv, 0);
+    exit(EXIT_FAILURE);
+  }
+  CryptReleaseContext(hCryptProv, 0);
+#else
+  FILE *fd = fopen("/dev/urandom", "rb");
+  assert(fd != NULL);
+  assert(fread(s->srtla_id, 1, SRTLA_ID_LEN, fd) == SRTLA_ID_LEN);
+  fclose(fd);
+#endif
+}
+
+int stream_listen(stream_t *s) {
+  struct sockaddr_in listen_addr;
+  listen_addr.sin_family = AF_INET;
+  listen_addr.sin_addr.s_addr = INADDR_ANY;
+  listen_addr.sin_port = htons(s->listen_port);
+  s->listenfd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (s->listenfd < 0) { 
+    perror("socket creation failed"); 
+    return -1;
+  }
+
+  int ret = bind(s->listenfd, (struct sockaddr *)&listen_addr, sizeof(listen_addr));
+  if (ret < 0) { 
+    perror("bind failed"); 
+    return -1;
+  }
+  add_active_fd(s->listenfd);
+
+  return 0;
+}
+
+// Resolve the address of the receiver
+int stream_resolve(stream_t *s) {
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  struct addrinfo *addrs;
+  int ret = getaddrinfo(s->srtla_host, s->srtla_port, &hints, &addrs);
+  if (ret != 0) {
+    err("Failed to resolve %s: %s\n", s->srtla_host, gai_strerror(ret));
+    return -1;
+  }
+
+  set_srtla_addr(s, addrs);
+  for (struct addrinfo *a = addrs; a != NULL && s->join_addr_cnt < JOIN_MAX_ADDRS; a = a->ai_next) {
+    memcpy(&s->join_addrs[s->join_addr_cnt++], a->ai_addr, a->ai_addrlen);
+  }
+  freeaddrinfo(addrs);
+
+  return 0;
 }
 
-#define ARG_LISTEN_PORT (argv[1])
-#define ARG_SRTLA_HOST  (argv[2])
-#define ARG_SRTLA_PORT  (argv[3])
-#define ARG_IPS_FILE    (argv[4])
 int main(int argc, char **argv) {
 #ifdef _WIN32
   // Windows için Winsock başlatma
@@ -806,9 +3500,21 @@ int main(int argc, char **argv) {
     exit(0);
   }
   if (argc < 5) exit_help();
+  get_ms(&startup_ms);
+
+  stream_t *first_stream = stream_add(ARG_LISTEN_PORT, ARG_SRTLA_HOST, ARG_SRTLA_PORT, 1);
+  if (first_stream == NULL) exit_help();
 
   for (int i = 5; i < argc; i++) {
-    if (strcmp(argv[i], "--no-auto-reconnect") == 0) {
+    if (strcmp(argv[i], "--stream") == 0 && i + 1 < argc) {
+      if (stream_add_spec(argv[i+1]) == NULL) {
+        err("Warning: invalid stream %s\n", argv[i+1]);
+      }
+      i++;
+    } else if (strcmp(argv[i], "--weight") == 0 && i + 1 < argc) {
+      first_stream->weight = max(atoi(argv[i+1]), 1);
+      i++;
+    } else if (strcmp(argv[i], "--no-auto-reconnect") == 0) {
       flag_auto_reconnect = 0;
     } else if (strcmp(argv[i], "--auto-reconnect") == 0) {
       flag_auto_reconnect = 1;
@@ -817,11 +3523,83 @@ int main(int argc, char **argv) {
     } else if (strcmp(argv[i], "--reconnect-interval-ms") == 0 && i + 1 < argc) {
       flag_reconnect_interval_ms = atoi(argv[i+1]);
       i++;
+    } else if (strcmp(argv[i], "--scheduler") == 0 && i + 1 < argc) {
+      if (strcmp(argv[i+1], "legacy") == 0) {
+        flag_scheduler = SCHED_LEGACY;
+      } else if (strcmp(argv[i+1], "latency") == 0) {
+        flag_scheduler = SCHED_LATENCY;
+      } else {
+        err("Warning: unknown scheduler %s\n", argv[i+1]);
+      }
+      i++;
+    } else if (strcmp(argv[i], "--pacing") == 0) {
+      flag_pacing = 1;
+    } else if (strcmp(argv[i], "--adaptive-sndbuf") == 0) {
+      flag_adaptive_sndbuf = 1;
+    } else if (strcmp(argv[i], "--flowlet") == 0) {
+      flag_flowlet = 1;
+    } else if (strcmp(argv[i], "--flowlet-bytes") == 0 && i + 1 < argc) {
+      flag_flowlet_bytes = atoi(argv[i+1]);
+      i++;
+    } else if (strcmp(argv[i], "--flowlet-ms") == 0 && i + 1 < argc) {
+      flag_flowlet_ms = atoi(argv[i+1]);
+      i++;
+    } else if (strcmp(argv[i], "--dup-retrans") == 0) {
+      flag_dup_retrans = 1;
+    } else if (strcmp(argv[i], "--no-netlink") == 0) {
+      flag_netlink = 0;
+    } else if (strcmp(argv[i], "--feedback-sock") == 0 && i + 1 < argc) {
+#ifndef _WIN32
+      flag_feedback_sock = argv[i+1];
+#else
+      err("Warning: --feedback-sock is not supported on this platform\n");
+#endif
+      i++;
+    } else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+      flag_metrics = argv[i+1];
+      i++;
+    } else if (strcmp(argv[i], "--latency-budget-ms") == 0 && i + 1 < argc) {
+      flag_latency_budget_ms = max(atoi(argv[i+1]), 0);
+      i++;
+    } else if (strcmp(argv[i], "--probe") == 0) {
+      flag_probe = 1;
+    } else if (strcmp(argv[i], "--probe-max-pct") == 0 && i + 1 < argc) {
+      flag_probe_max_pct = min_max(atoi(argv[i+1]), 1, 100);
+      i++;
+    } else if (strcmp(argv[i], "--fec") == 0 && i + 1 < argc) {
+      flag_fec = atoi(argv[i+1]);
+      if (flag_fec < 0 || flag_fec > FEC_MAX_K) {
+        err("Warning: invalid FEC group size %s, FEC disabled\n", argv[i+1]);
+        flag_fec = 0;
+      }
+      i++;
+    } else if (strcmp(argv[i], "--threads") == 0) {
+#ifdef HAVE_THREADS
+      flag_threads = 1;
+#else
+      err("Warning: --threads is not supported on this platform\n");
+#endif
+    } else if (strcmp(argv[i], "--cc") == 0 && i + 1 < argc) {
+      if (strcmp(argv[i+1], "legacy") == 0) {
+        flag_cc = CC_LEGACY;
+      } else if (strcmp(argv[i+1], "bbr") == 0) {
+        flag_cc = CC_BBR;
+      } else {
+        err("Warning: unknown congestion control %s\n", argv[i+1]);
+      }
+      i++;
     } else {
       err("Warning: unknown option %s\n", argv[i]);
     }
   }
 
+  for (stream_t *s = streams; s != NULL; s = s->next) {
+    if (flag_fec) {
+      s->reg_caps_offered |= SRTLA_CAP_FEC;
+    }
+    stream_gen_id(s);
+  }
+
   source_ip_file = ARG_IPS_FILE;
   int conn_count = setup_conns(source_ip_file);
   if (conn_count <= 0) {
@@ -829,67 +3607,54 @@ int main(int argc, char **argv) {
     exit(EXIT_FAILURE);
   }
 
-  struct sockaddr_in listen_addr;
-  int port = parse_port(ARG_LISTEN_PORT);
-  if (port < 0) exit_help();
+  FD_ZERO(&active_fds);
 
-  // Read a random connection group id for this session
-#ifdef _WIN32
-  // Windows'ta /dev/urandom yok, bunun yerine CryptGenRandom kullanabiliriz
-  HCRYPTPROV hCryptProv;
-  if (!CryptAcquireContext(&hCryptProv, NULL, NULL, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT)) {
-    fprintf(stderr, "CryptAcquireContext failed: %lu\n", GetLastError());
-    exit(EXIT_FAILURE);
+  for (stream_t *s = streams; s != NULL; s = s->next) {
+    if (stream_listen(s) != 0) {
+      exit(EXIT_FAILURE);
+    }
   }
-  if (!CryptGenRandom(hCryptProv, SRTLA_ID_LEN, (BYTE*)srtla_id)) {
-    fprintf(stderr, "CryptGenRandom failed: %lu\n", GetLastError());
-    CryptReleaseContext(hCryptProv, 0);
+
+#ifdef HAVE_THREADS
+  if (flag_threads && fb_init() != 0) {
+    err("Failed to set up the link thread feedback queue\n");
     exit(EXIT_FAILURE);
   }
-  CryptReleaseContext(hCryptProv, 0);
-#else
-  FILE *fd = fopen("/dev/urandom", "rb");
-  assert(fd != NULL);
-  assert(fread(srtla_id, 1, SRTLA_ID_LEN, fd) == SRTLA_ID_LEN);
-  fclose(fd);
 #endif
 
-  FD_ZERO(&active_fds);
-
-  listen_addr.sin_family = AF_INET;
-  listen_addr.sin_addr.s_addr = INADDR_ANY;
-  listen_addr.sin_port = htons(port);
-  listenfd = socket(AF_INET, SOCK_DGRAM, 0);
-  if (listenfd < 0) { 
-    perror("socket creation failed"); 
-    exit(EXIT_FAILURE); 
+  int connected = open_conns();
+  if (connected < 1) {
+    err("Failed to open and bind to any of the IP addresses in %s\n", source_ip_file);
+    exit(EXIT_FAILURE);
   }
 
-  int ret = bind(listenfd, (struct sockaddr *)&listen_addr, sizeof(listen_addr));
-  if (ret < 0) { 
-    perror("bind failed"); 
-    exit(EXIT_FAILURE); 
+  for (stream_t *s = streams; s != NULL; s = s->next) {
+    if (stream_resolve(s) != 0) {
+      exit(EXIT_FAILURE);
+    }
   }
-  add_active_fd(listenfd);
 
-  int connected = open_conns(ARG_SRTLA_HOST, ARG_SRTLA_PORT);
-  if (connected < 1) {
-    err("Failed to open and bind to any of the IP addresses in %s\n", source_ip_file);
+#ifndef _WIN32
+  if (flag_feedback_sock && feedback_init(flag_feedback_sock) != 0) {
+    err("Failed to set up the feedback socket %s\n", flag_feedback_sock);
     exit(EXIT_FAILURE);
   }
+#endif
 
-  // Resolve the address of the receiver
-  struct addrinfo hints;
-  memset(&hints, 0, sizeof(hints));
-  hints.ai_family = AF_INET;
-  hints.ai_socktype = SOCK_DGRAM;
-  ret = getaddrinfo(ARG_SRTLA_HOST, ARG_SRTLA_PORT, &hints, &addrs);
-  if (ret != 0) {
-    err("Failed to resolve %s: %s\n", ARG_SRTLA_HOST, gai_strerror(ret));
-    exit(EXIT_FAILURE);
+  if (flag_metrics) {
+    metrics_sock = metrics_listen(flag_metrics);
+    if (metrics_sock < 0) {
+      err("Failed to listen for metrics scrapes at %s\n", flag_metrics);
+      exit(EXIT_FAILURE);
+    }
+    add_active_fd(metrics_sock);
   }
 
-  set_srtla_addr(addrs);
+#ifdef __linux__
+  if (flag_netlink && nl_init() != 0) {
+    err("Failed to subscribe to link state changes, relying on timeouts\n");
+  }
+#endif
 
 #ifndef _WIN32
   signal(SIGHUP, schedule_update_conns);
@@ -901,17 +3666,41 @@ int main(int argc, char **argv) {
     if (do_update_conns) {
       update_conns(source_ip_file);
       do_update_conns = 0;
+#ifdef __linux__
+      if (nl_fd >= 0) {
+        nl_request_addrs();
+      }
+#endif
     }
 
     connection_housekeeping();
 
+    uint64_t ts;
+    get_us(&ts);
+    uint64_t pace_wait = min(PACE_MAX_WAIT, liveness_tick(ts));
+#ifndef _WIN32
+    feedback_tick(ts);
+#endif
+    if (flag_pacing) {
+      pace_flush(ts);
+      pace_wait = min(pace_wait, pace_next_wait());
+    }
+    if (metrics_busy()) {
+      metrics_poll();
+      pace_wait = min(pace_wait, METRICS_POLL_INT * 1000);
+    }
+
     fd_set read_fds = active_fds;
-    struct timeval to = {.tv_sec = 0, .tv_usec = 200*1000};
-    ret = select(FD_SETSIZE, &read_fds, NULL, NULL, &to);
+    struct timeval to = {.tv_sec = 0, .tv_usec = pace_wait};
+    int ret = select(FD_SETSIZE, &read_fds, NULL, NULL, &to);
+    loop_iters++;
 
     if (ret > 0) {
-      if (FD_ISSET(listenfd, &read_fds)) {
-        handle_srt_data(listenfd);
+      loop_wakeups++;
+      for (stream_t *s = streams; s != NULL; s = s->next) {
+        if (FD_ISSET(s->listenfd, &read_fds)) {
+          handle_srt_data(s);
+        }
       }
 
       for (conn_t *c = conns; c != NULL; c = c->next) {
@@ -919,15 +3708,101 @@ int main(int argc, char **argv) {
           handle_srtla_data(c);
         }
       }
+
+#ifdef HAVE_THREADS
+      if (fb_pipe[0] >= 0 && FD_ISSET(fb_pipe[0], &read_fds)) {
+        fb_drain();
+      }
+#endif
+#ifdef __linux__
+      if (nl_fd >= 0 && FD_ISSET(nl_fd, &read_fds)) {
+        nl_handle();
+      }
+#endif
+      if (metrics_sock >= 0 && FD_ISSET(metrics_sock, &read_fds)) {
+        metrics_serve(metrics_sock, metrics_fill);
+      }
     } // ret > 0
 
     info_int--;
     if (info_int == 0) {
       for (conn_t *c = conns; c != NULL; c = c->next) {
-        debug("%s (%p): in flight: %d, window: %d, last_rcvd %ld\n",
-              print_addr(&c->src), c, c->in_flight_pkts, c->window, c->last_rcvd);
+        debug("%s (%p): in flight: %d (%d bytes), window: %d, last_rcvd %ld, "
+              "srtt %d ms, rttvar %d ms, min rtt %d ms, bw %lld kbps, "
+              "pacing rate %lld kbps, pacing delay avg %d us max %d us, "
+              "pacing queue %d, overflows %d, socket queue %d bytes, sndbuf %d, "
+              "duplicate acks %d, loss %d permille\n",
+              print_addr(&c->src), c, c->in_flight_pkts, c->in_flight_bytes,
+              c->window, c->last_rcvd, c->srtt / 1000, c->rttvar / 1000,
+              c->min_rtt / 1000, (long long)(c->bw_est * 8 / 1000),
+              (long long)(conn_pacing_rate(c) * 8 / 1000),
+              c->pace_delay_cnt ? (int)(c->pace_delay_sum / c->pace_delay_cnt) : 0,
+              (int)c->pace_delay_max, c->pace_q_len, c->pace_overflows,
+              c->outq_bytes, c->sndbuf, c->dup_acks, c->loss_rate);
+        c->pace_delay_sum = 0;
+        c->pace_delay_max = 0;
+        c->pace_delay_cnt = 0;
+        if (c->probe_pkts) {
+          debug("%s (%p): %s, %d probe packets sent\n", print_addr(&c->src), c,
+                c->probing ? "probing" : "not probing", c->probe_pkts);
+        }
+        if (c->detect_cnt) {
+          debug("%s (%p): suspended %d times, detection time avg %d ms max %d ms, "
+                "rto %d ms%s\n",
+                print_addr(&c->src), c, c->detect_cnt,
+                (int)(c->detect_sum / c->detect_cnt / 1000), (int)(c->detect_max / 1000),
+                (int)(conn_rto(c) / 1000), c->suspect ? ", suspended" : "");
+        }
+#ifdef HAVE_THREADS
+        link_worker_t *w = c->worker;
+        if (w) {
+          debug("%s (%p): link thread: sent %llu packets (%llu bytes), "
+                "tx queue %u, tx drops %llu, send errors %llu, rx drops %llu\n",
+                print_addr(&c->src), c,
+                (unsigned long long)atomic_load_explicit(&w->tx_pkts, memory_order_relaxed),
+                (unsigned long long)atomic_load_explicit(&w->tx_bytes, memory_order_relaxed),
+                atomic_load(&w->tx_tail) - atomic_load(&w->tx_head),
+                (unsigned long long)c->tx_drops,
+                (unsigned long long)atomic_load_explicit(&w->tx_errors, memory_order_relaxed),
+                (unsigned long long)atomic_load_explicit(&w->rx_drops, memory_order_relaxed));
+        }
+#endif
+      }
+      debug("packets from the SRT caller: %s %d, %s %d, %s %d\n",
+            pkt_class_names[PKT_DATA], pkt_class_cnt[PKT_DATA],
+            pkt_class_names[PKT_RETRANS], pkt_class_cnt[PKT_RETRANS],
+            pkt_class_names[PKT_CONTROL], pkt_class_cnt[PKT_CONTROL]);
+      if (flag_probe) {
+        debug("probe packets: %d bytes sent\n", probe_bytes);
       }
-      info_int = LOG_PKT_INT;    }
+      if (flag_latency_budget_ms) {
+        debug("stale packets dropped: %s %d, %s %d, sent over another link %d, oldest packet sent %d ms\n",
+              pkt_class_names[PKT_DATA], stale_drops[PKT_DATA],
+              pkt_class_names[PKT_RETRANS], stale_drops[PKT_RETRANS],
+              stale_rescued, (int)(sent_age_max / 1000));
+        sent_age_max = 0;
+      }
+      int fec_active = 0;
+      for (stream_t *s = streams; s != NULL; s = s->next) {
+        fec_active |= s->fec_active;
+      }
+      if (fec_active) {
+        debug("FEC parity packets: sent %d, skipped %d\n",
+              fec_parity_sent, fec_parity_skipped);
+      }
+      debug("rx batch sizes: 1: %d, 2-3: %d, 4-7: %d, 8-15: %d, 16-31: %d, 32+: %d\n",
+            rx_batch_hist[0], rx_batch_hist[1], rx_batch_hist[2],
+            rx_batch_hist[3], rx_batch_hist[4], rx_batch_hist[5]);
+      debug("tx batch sizes: 1: %d, 2-3: %d, 4-7: %d, 8-15: %d, 16-31: %d, 32+: %d\n",
+            tx_batch_hist[0], tx_batch_hist[1], tx_batch_hist[2],
+            tx_batch_hist[3], tx_batch_hist[4], tx_batch_hist[5]);
+      pkt_pool_stats_t pool;
+      pkt_pool_get_stats(&pool);
+      debug("packet buffers: %d in use of %d, %llu allocations, %llu mallocs\n",
+            pool.in_use, pool.total, (unsigned long long)pool.allocs,
+            (unsigned long long)pool.mallocs);
+      info_int = LOG_PKT_INT;
+    }
   } // while(1)
 
 #ifdef _WIN32